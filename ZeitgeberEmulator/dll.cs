@@ -98,7 +98,7 @@ namespace Zeitgeber
         public static extern void UpdateButton(byte idx, bool state);
 
         [DllImport(DLL_NAME, EntryPoint = "zSetSystick", CallingConvention = CallingConvention.StdCall)]
-        public static extern void SetSystick(UInt16 systick);
+        public static extern void SetSystick(UInt32 systick);
 
 
         #endregion
@@ -16,8 +16,8 @@ namespace ZeitgeberEmulator
     {
         //public Dictionary<string, object> info;
         private static int startTick = 0;
-        public static UInt16 fastTick = 0;
-        public static UInt16 slowTick = 0;
+        public static UInt32 fastTick = 0;
+        public static UInt32 slowTick = 0;
 
         public fmMain()
         {
@@ -176,17 +176,17 @@ namespace ZeitgeberEmulator
 
         private void tickTimer_Tick(object sender, EventArgs e)
         {
-            //UInt16 tick = (cbSlowTick.Checked) ? (UInt16)(slowTick+fastTick) : fastTick;
-            UInt16 tick = (UInt16)(slowTick + fastTick);
+            //UInt32 tick = (cbSlowTick.Checked) ? (UInt32)(slowTick+fastTick) : fastTick;
+            UInt32 tick = slowTick + fastTick;
 
             if (!cbSlowTick.Checked)
-                fastTick = (UInt16)(Environment.TickCount - startTick);
+                fastTick = (UInt32)(Environment.TickCount - startTick);
             else
-                slowTick = (UInt16)((Environment.TickCount - startTick) / 100);
+                slowTick = (UInt32)((Environment.TickCount - startTick) / 100);
 
             lblSysTick.Text = String.Format("{0} ms", tick);
 
-            dll.SetSystick((UInt16)tick);
+            dll.SetSystick(tick);
             dll.Process();
         }
     }
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include "core/kernel.h"
 #include "core/os.h"
+#include "core/boot.h"
 #include "app.h"
 
 ////////// Variables ///////////////////////////////////////////////////////////
@@ -25,22 +26,30 @@ application_t* foreground_app = NULL;
 void RegisterUserApplication(application_t* app) {
 
     // Assign a scheduler task to the app
+    // (background processing, so it shouldn't hold up the system)
     if (app->process != NULL)
-        app->task = RegisterTask(app->name, app->process);
+        app->task = RegisterTask(app->name, app->process, prLow, app->stack_size);
 
     installed_apps[app_count++] = app;
 }
 
+void InitializeApplication(application_t* app) {
+    if (app->initialized)
+        return;
+    app->initialized = true;
+
+    ClrWdt();
+    printf("\t%s\n", app->name);
+
+    if (app->init != NULL)
+        app->init();
+    BootStage(app->name);
+}
+
 void InitializeApplications() {
     uint i;
-    for (i=0; i<app_count; i++) {
-        ClrWdt();
-        application_t* app = installed_apps[i];
-        printf("\t%s\n", app->name);
-
-        if (app->init != NULL)
-            app->init();
-    }
+    for (i=0; i<app_count; i++)
+        InitializeApplication(installed_apps[i]);
 }
 
 void SetForegroundApp(application_t* app) {
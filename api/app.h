@@ -14,20 +14,34 @@
 
 #define MAX_APPLICATIONS 10
 
-typedef enum { evtUnknown, evtBtnPress, evtBtnRelease, evtScreenOff, evtScreenOn } event_type_t;
+typedef enum { evtUnknown, evtBtnPress, evtBtnRelease, evtScreenOff, evtScreenOn, evtBtnLongPress, evtBtnRepeat } event_type_t;
 
 typedef void (*event_proc_t)(event_type_t, uint param);
 
+// How often the foreground app is redrawn (besides after input or RequestRedraw)
+typedef enum {
+    rdContinuous,   // At 'fps' frames per second (the default)
+    rdOnDemand,     // Only when the app calls RequestRedraw
+    rdSecond,       // Every second
+    rdMinute        // On the minute
+} redraw_policy_t;
+
 typedef struct {
     char name[6];
 
     proc_t init;
     proc_t process;     // Optional background processing task
     proc_t draw;
+    tick_t (*prerender)(void); // Optional: draw the next predictable frame (eg. the next minute)
+                               // and return the systick it should be shown at. Runs when idle.
     event_proc_t event;
+    redraw_policy_t redraw;
+    uint8 fps;          // rdContinuous frame rate (defaults to 1000/DRAW_INTERVAL)
+    uint16 stack_size;  // Optional background task stack size (defaults to TASK_STACK_SIZE)
 
     // READ ONLY, SYSTEM USE
     bool isForeground;  // App is currently the foreground process being drawn on the screen
+    bool initialized;   // init has been called
     task_t* task;       // task is only registered if process is not null
 } application_t;
 
@@ -43,6 +57,9 @@ void AppForegroundEvent(event_type_t type, uint param);
 // Send an event to all registered apps
 void AppGlobalEvent(event_type_t type, uint param);
 
+// Call the initialization function of an application (only the first time)
+void InitializeApplication(application_t* app);
+
 // Call the initialization function on all registered applications
 void InitializeApplications();
 
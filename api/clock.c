@@ -204,7 +204,7 @@ void TimestampAddMinute(timestamp_t* ts, int minutes) {
 
 void TimestampAddHour(timestamp_t* ts, int hours) {
     int carry = 0;
-    ts->hour = (byte)AddCarry(ts->hour, hours, 1, 12, &carry);
+    ts->hour = (byte)AddCarry(ts->hour, hours, 0, 23, &carry);
     if (carry != 0) {
         TimestampAddDay(ts, carry);
     }
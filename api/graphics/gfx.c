@@ -12,15 +12,78 @@
 ////////// Includes ////////////////////////////////////////////////////////////
 
 #include <system.h>
+#include <string.h>
 #include "gfx.h"
+#include "core/kernel.h"
 #include <drivers\ssd1351.h>
 
 ////////// Variables ///////////////////////////////////////////////////////////
 
-// Internal screen buffer
-__eds__ color_t screen[DISPLAY_SIZE] __attribute__((space(eds),section(".gfx"),eds));
+// Internal screen buffers. One is shown on the display (screen), the other
+// is for pre-rendering the next frame (offscreen). SwapScreenBuffers() flips them.
+static __eds__ color_t frame_buffer_a[DISPLAY_SIZE] __attribute__((space(eds),section(".gfx"),eds));
+static __eds__ color_t frame_buffer_b[DISPLAY_SIZE] __attribute__((space(eds),section(".gfx"),eds));
 //color_t screen[DISPLAY_SIZE-1];
 
+__eds__ color_t* screen = frame_buffer_a;
+__eds__ color_t* offscreen = frame_buffer_b;
+
+// Buffer the drawing functions write to (see DrawToOffscreen)
+static __eds__ color_t* draw_buffer = frame_buffer_a;
+static bool draw_offscreen = false;
+
+// Damage tracking. For each buffer row, the columns drawn since the buffer was
+// last cleared (everything else is black), so UpdateDisplay only has to push
+// the rows and columns that were drawn in either the new or the old frame.
+typedef struct {
+    uint8 x1, x2;       // Inclusive, x1 > x2 if nothing was drawn
+} span_t;
+
+typedef struct {
+    bool valid;         // Not cleared yet, so it could all be drawn
+    span_t rows[DISPLAY_HEIGHT];
+} damage_t;
+
+static damage_t damage_a, damage_b;
+static damage_t* screen_damage = &damage_a;
+static damage_t* offscreen_damage = &damage_b;
+static damage_t* draw_damage = &damage_a;
+static damage_t display_damage;     // Frame that is on the display now
+
+// Tile hashes of the frame on the display, so tiles that were redrawn the same
+// aren't pushed again. A black tile hashes to 0, so tiles with no damage in
+// either frame are known without hashing them.
+#define TILE_SIZE 16
+#define TILES_X (DISPLAY_WIDTH / TILE_SIZE)
+#define TILES_Y (DISPLAY_HEIGHT / TILE_SIZE)
+
+#define FNV_OFFSET 2166136261UL
+#define FNV_PRIME 16777619UL
+
+static uint32 tile_hash[TILES_Y][TILES_X];
+static bool tile_hash_valid = false;
+
+// Rows are pushed in windows, merging rows while that wastes fewer than this
+// many pixels (roughly the cost of the address commands for a new window)
+#define WINDOW_OVERHEAD 16
+
+// Transition in progress (see TransitionStart)
+#define WIPE_BAR_WIDTH 2
+#define WIPE_BAR_COLOR SKYBLUE
+#define FADE_CONTRAST 0x0E      // Master contrast after ssd1351_DisplayOn
+
+static struct {
+    transition_t type;
+    int dir;
+    uint duration;      // systicks
+    uint interval;      // systicks between frames
+    tick_t start;       // Start of the timeline (fade: of the current half)
+    uint x;             // Wipe: columns shown, slide: columns slid in, fade: columns pushed while dark
+    uint pushed;        // Slide: columns of the current position pushed so far
+    uint contrast;      // Fade: master contrast now
+    bool fading_in;
+} transition;
+
 drawop_t global_drawop = SRCCOPY;
 
 // Custom fonts
@@ -45,12 +108,300 @@ extern int16 sine_table[];
 
 ////////// Device Dependant Functions //////////////////////////////////////////
 
+static INLINE span_t RowDamage(damage_t* damage, uint y) {
+    static const span_t full = { 0, DISPLAY_WIDTH-1 };
+    return (damage->valid) ? damage->rows[y] : full;
+}
+
+static INLINE span_t SpanUnion(span_t a, span_t b) {
+    if (a.x1 > a.x2) return b;
+    if (b.x1 > b.x2) return a;
+    if (b.x1 < a.x1) a.x1 = b.x1;
+    if (b.x2 > a.x2) a.x2 = b.x2;
+    return a;
+}
+
+static void ResetDamage(damage_t* damage, bool all_drawn) {
+    uint y;
+    for (y = 0; y < DISPLAY_HEIGHT; y++) {
+        damage->rows[y].x1 = (all_drawn) ? 0 : DISPLAY_WIDTH-1;
+        damage->rows[y].x2 = (all_drawn) ? DISPLAY_WIDTH-1 : 0;
+    }
+    damage->valid = true;
+}
+
+static uint32 TileHash(uint tx, uint ty) {
+    // FNV-1a over the pixels. Unlike a sum it changes when pixels move around
+    // the tile (eg. two digits of the same size swapping places).
+    uint j = ty * TILE_SIZE * DISPLAY_WIDTH + tx * TILE_SIZE;
+    uint32 hash = FNV_OFFSET;
+    color_t drawn = 0;
+    uint x, y;
+    for (y=0; y<TILE_SIZE; y++) {
+        for (x=0; x<TILE_SIZE; x++) {
+            color_t c = screen[j++];
+            hash = (hash ^ c) * FNV_PRIME;
+            drawn |= c;
+        }
+        j += DISPLAY_WIDTH - TILE_SIZE;
+    }
+
+    // 0 is kept for black tiles
+    if (!drawn)
+        return 0;
+    return (hash) ? hash : 1;
+}
+
+static INLINE span_t SpanClip(span_t a, uint8 left, uint8 right) {
+    if (a.x1 < left) a.x1 = left;
+    if (a.x2 > right) a.x2 = right;
+    return a;
+}
+
+// Push the tiles tx1 to tx2-1 of tile row ty, given the damage of its rows.
+// Only the part drawn in either frame can differ, the rest is black in both,
+// so rows are sent as their damaged spans, grouped into rectangular windows.
+static void PushTiles(span_t* rows, uint ty, uint tx1, uint tx2) {
+    uint8 left = tx1 * TILE_SIZE, right = tx2 * TILE_SIZE - 1;
+    uint y = 0;
+
+    while (y < TILE_SIZE) {
+        span_t band = SpanClip(rows[y], left, right);
+        if (band.x1 > band.x2) {
+            y++;
+            continue;
+        }
+
+        uint y1 = y++;
+        while (y < TILE_SIZE) {
+            span_t row = SpanClip(rows[y], left, right);
+            if (row.x1 > row.x2)
+                break;
+
+            // Pixels that would be pushed needlessly by widening the window
+            span_t merged = SpanUnion(band, row);
+            uint w = merged.x2 - merged.x1 + 1;
+            uint waste = (w - (band.x2 - band.x1 + 1)) * (y - y1) + (w - (row.x2 - row.x1 + 1));
+            if (waste > WINDOW_OVERHEAD)
+                break;
+
+            band = merged;
+            y++;
+        }
+
+        ssd1351_UpdateWindow(screen, band.x1, ty * TILE_SIZE + y1, band.x2 - band.x1 + 1, y - y1);
+    }
+}
+
+// Rehash the damaged tiles, and push the ones that changed if 'push' is set
+static void UpdateTiles(bool push) {
+    span_t rows[TILE_SIZE];
+    uint tx, ty, y;
+
+    for (ty=0; ty<TILES_Y; ty++) {
+        // Tiles with anything drawn in them, in the new frame or on the display
+        uint damaged = 0;
+        for (y=0; y<TILE_SIZE; y++) {
+            uint row = ty * TILE_SIZE + y;
+            rows[y] = SpanUnion(RowDamage(screen_damage, row), RowDamage(&display_damage, row));
+            if (rows[y].x1 <= rows[y].x2)
+                damaged |= (2 << (rows[y].x2 / TILE_SIZE)) - (1 << (rows[y].x1 / TILE_SIZE));
+        }
+
+        uint changed = 0;
+        for (tx=0; tx<TILES_X; tx++) {
+            uint32 hash = (damaged & (1 << tx)) ? TileHash(tx, ty) : 0;
+            if (hash != tile_hash[ty][tx] || !tile_hash_valid)
+                changed |= 1 << tx;
+            tile_hash[ty][tx] = hash;
+        }
+
+        if (!push)
+            continue;
+
+        // Each run of changed tiles goes in one window
+        tx = 0;
+        while (tx < TILES_X) {
+            if (!(changed & (1 << tx))) {
+                tx++;
+                continue;
+            }
+            uint tx1 = tx;
+            while (tx < TILES_X && (changed & (1 << tx)))
+                tx++;
+            PushTiles(rows, ty, tx1, tx);
+        }
+    }
+
+    // The display now shows exactly the screen buffer
+    tile_hash_valid = true;
+    memcpy(&display_damage, screen_damage, sizeof(damage_t));
+}
+
 void UpdateDisplay() {
-    ssd1351_UpdateScreen(screen, DISPLAY_SIZE);
+    UpdateTiles(true);
+}
+
+void InvalidateDisplay() {
+    display_damage.valid = false;
+    tile_hash_valid = false;
+}
+
+void DisplayCleared() {
+    uint ty, tx;
+    for (ty=0; ty<TILES_Y; ty++)
+        for (tx=0; tx<TILES_X; tx++)
+            tile_hash[ty][tx] = 0;
+    tile_hash_valid = true;
+    ResetDamage(&display_damage, false);
 }
 
-void UpdateDisplayWipeIn(int dir) {
-    ssd1351_WipeIn(screen, dir);
+bool DrawToOffscreen(bool enable) {
+    bool prev = draw_offscreen;
+    draw_offscreen = enable;
+    draw_buffer = (enable) ? offscreen : screen;
+    draw_damage = (enable) ? offscreen_damage : screen_damage;
+    return prev;
+}
+
+void SwapScreenBuffers() {
+    __eds__ color_t* buf = screen;
+    screen = offscreen;
+    offscreen = buf;
+
+    damage_t* damage = screen_damage;
+    screen_damage = offscreen_damage;
+    offscreen_damage = damage;
+
+    draw_buffer = (draw_offscreen) ? offscreen : screen;
+    draw_damage = (draw_offscreen) ? offscreen_damage : screen_damage;
+}
+
+////////// Transitions /////////////////////////////////////////////////////////
+
+void TransitionStart(transition_t type, int dir, uint duration, uint fps) {
+    transition.type = type;
+    transition.dir = dir;
+    transition.duration = (type == trFade) ? duration / 2 : duration;
+    if (transition.duration == 0)
+        transition.duration = 1;
+    transition.interval = (fps != 0) ? SecondsToTicks(1) / fps : 1;
+    if (transition.interval == 0)
+        transition.interval = 1;
+    transition.start = GetTicks();
+    transition.x = 0;
+    transition.pushed = 0;
+    transition.contrast = FADE_CONTRAST;
+    transition.fading_in = false;
+}
+
+// How far along the timeline (or the current half of a fade) is, in 0-max
+static uint Timeline(uint max) {
+    uint32 elapsed = TickDiff(GetTicks(), transition.start);
+    if (elapsed >= transition.duration)
+        return max;
+    return elapsed * max / transition.duration;
+}
+
+// Columns x to x+w-1, counted in the direction the transition moves
+static INLINE uint ToScreenX(uint x, uint w) {
+    return (transition.dir > 0) ? x : DISPLAY_WIDTH - x - w;
+}
+
+static void PushColumns(uint src_x, uint x, uint w) {
+    ssd1351_CopyWindow(screen, ToScreenX(src_x, w), ToScreenX(x, w), 0, w, DISPLAY_HEIGHT);
+}
+
+static uint WipeStep() {
+    uint x = Timeline(DISPLAY_WIDTH);
+    if (x > transition.x + TRANSITION_MAX_COLUMNS)
+        x = transition.x + TRANSITION_MAX_COLUMNS;
+
+    if (x > transition.x) {
+        PushColumns(transition.x, transition.x, x - transition.x);
+        transition.x = x;
+
+        uint bar = DISPLAY_WIDTH - x;
+        if (bar > WIPE_BAR_WIDTH)
+            bar = WIPE_BAR_WIDTH;
+        if (bar != 0)
+            ssd1351_FillWindow(ToScreenX(x, bar), 0, bar, DISPLAY_HEIGHT, WIPE_BAR_COLOR);
+    }
+
+    return (transition.x == DISPLAY_WIDTH) ? 0 : transition.interval;
+}
+
+static uint SlideStep() {
+    // Each position is a whole new frame (every column moves), so it's
+    // pushed over as many steps as it takes
+    if (transition.pushed == transition.x) {
+        uint x = Timeline(DISPLAY_WIDTH);
+        if (x == transition.x)
+            return (x == DISPLAY_WIDTH) ? 0 : transition.interval;
+        transition.x = x;
+        transition.pushed = 0;
+    }
+
+    // The leading x columns show the last x columns of the new frame
+    uint w = transition.x - transition.pushed;
+    if (w > TRANSITION_MAX_COLUMNS)
+        w = TRANSITION_MAX_COLUMNS;
+    PushColumns(DISPLAY_WIDTH - transition.x + transition.pushed, transition.pushed, w);
+    transition.pushed += w;
+
+    if (transition.pushed < transition.x)
+        return 1;
+    return (transition.x == DISPLAY_WIDTH) ? 0 : transition.interval;
+}
+
+static uint FadeStep() {
+    if (!transition.fading_in && transition.contrast != 0) {
+        uint contrast = FADE_CONTRAST - Timeline(FADE_CONTRAST);
+        if (contrast != transition.contrast)
+            ssd1351_SetContrast(transition.contrast = contrast);
+        return (contrast == 0) ? 1 : transition.interval;
+    }
+
+    if (!transition.fading_in) {
+        // Swap the frame while nothing shows
+        uint w = DISPLAY_WIDTH - transition.x;
+        if (w > TRANSITION_MAX_COLUMNS)
+            w = TRANSITION_MAX_COLUMNS;
+        ssd1351_UpdateWindow(screen, transition.x, 0, w, DISPLAY_HEIGHT);
+        transition.x += w;
+        if (transition.x < DISPLAY_WIDTH)
+            return 1;
+
+        transition.fading_in = true;
+        transition.start = GetTicks();
+        return transition.interval;
+    }
+
+    uint contrast = Timeline(FADE_CONTRAST);
+    if (contrast != transition.contrast)
+        ssd1351_SetContrast(transition.contrast = contrast);
+    return (contrast == FADE_CONTRAST) ? 0 : transition.interval;
+}
+
+uint TransitionStep() {
+    uint wait;
+    switch (transition.type) {
+        case trSlide: wait = SlideStep(); break;
+        case trFade: wait = FadeStep(); break;
+        default: wait = WipeStep(); break;
+    }
+
+    // The display now shows exactly the screen buffer
+    if (wait == 0)
+        UpdateTiles(false);
+    return wait;
+}
+
+void TransitionCancel() {
+    // Don't leave the display dark part way through a fade
+    if (transition.type == trFade && transition.contrast != FADE_CONTRAST)
+        ssd1351_SetContrast(transition.contrast = FADE_CONTRAST);
+    InvalidateDisplay();
 }
 
 ////////// Low Level Functions /////////////////////////////////////////////////
@@ -167,13 +518,15 @@ static INLINE void DrawOp(drawop_t drawop, __eds__ color_t* destbuf, __eds__ col
 void ClearImage() {
     int i;
     for (i = 0; i < DISPLAY_SIZE; i++)
-        screen[i] = 0x00;
+        draw_buffer[i] = 0x00;
+    ResetDamage(draw_damage, false);
 }
 
 void ClearImageEx(color_t c) {
     int i;
     for (i = 0; i < DISPLAY_SIZE; i++)
-        screen[i] = c;
+        draw_buffer[i] = c;
+    ResetDamage(draw_damage, c != 0x00);
 }
 
 static INLINE uint byte_index(uint8 x, uint8 y) {
@@ -184,21 +537,36 @@ static INLINE uint byte_index(uint8 x, uint8 y) {
 #endif
 }
 
+// Record that the pixel at buffer index idx was drawn (idx must be on screen)
+static INLINE void MarkDamage(uint idx) {
+    span_t* span = &draw_damage->rows[idx / DISPLAY_WIDTH];
+    uint8 x = idx % DISPLAY_WIDTH;
+    if (x < span->x1) span->x1 = x;
+    if (x > span->x2) span->x2 = x;
+}
+
 /*INLINE int bit_index(uint8 x) {
     return x % 8;
 }*/
 
 // Set a single pixel
 void SetPixel(uint8 x, uint8 y, color_t color) {
+    // Drawing isn't clipped, and past the end is the other frame buffer
+    if (x >= DISPLAY_WIDTH || y >= DISPLAY_HEIGHT)
+        return;
     uint idx = byte_index(x,y);
 	//screen[idx] = color;
-    DrawOp(global_drawop, &screen[idx], &color, NULL, false);
+    DrawOp(global_drawop, &draw_buffer[idx], &color, NULL, false);
+    MarkDamage(idx);
 }
 
 // Invert the colour of a pixel (XOR)
 void TogglePixel(uint8 x, uint8 y) {
+    if (x >= DISPLAY_WIDTH || y >= DISPLAY_HEIGHT)
+        return;
     uint idx = byte_index(x,y);
-	screen[idx] ^= 0xFFFF;
+	draw_buffer[idx] ^= 0xFFFF;
+    MarkDamage(idx);
 }
 
 // Returns colour for the given pixel
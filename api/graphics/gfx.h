@@ -108,11 +108,52 @@ color_t GetPixel(uint8 x, uint8 y);
 
 ///// Display /////
 
-// Copy the screen buffer to the display
+// Copy the screen buffer to the display.
+// Only the parts drawn since the last ClearImage (in this frame or the last) are
+// looked at, and only 16x16 tiles that differ from the display are sent.
 extern void UpdateDisplay();
 
+// Send the whole screen buffer on the next UpdateDisplay
+// (eg. after writing to the display directly)
+extern void InvalidateDisplay();
+
+// The display RAM was cleared to black (eg. by powering it on)
+extern void DisplayCleared();
+
+///// Transitions /////
+
+typedef enum {
+    trWipe,     // The new frame is uncovered behind a moving bar
+    trSlide,    // The new frame slides in over the old one
+    trFade      // The old frame fades out and the new one fades in
+} transition_t;
+
+// Start animating from what's on the display to the screen buffer, over
+// 'duration' systicks at up to 'fps' frames per second. dir is the direction
+// it moves in: +1 left to right, -1 right to left.
+extern void TransitionStart(transition_t type, int dir, uint duration, uint fps);
+
+// Send the next step of the transition to the display, at most
+// TRANSITION_MAX_COLUMNS columns of pixels. Returns the systicks to wait
+// before the next step, or 0 once the display shows the screen buffer.
+extern uint TransitionStep();
+
+// Abandon the transition in progress. The display is left part way through,
+// so the next UpdateDisplay() pushes the whole screen buffer.
+extern void TransitionCancel();
+
+#define TRANSITION_MAX_COLUMNS 32
+
 ///// Screen Buffer /////
 
+// Draw into the off-screen buffer instead of the screen buffer (eg. to pre-render
+// the next frame). Returns the previous setting, so it can be restored.
+extern bool DrawToOffscreen(bool enable);
+
+// Show the off-screen buffer: it becomes the screen buffer, and the old screen
+// buffer becomes the off-screen buffer. Call UpdateDisplay() to push it.
+extern void SwapScreenBuffers();
+
 // Clear the internal screen buffer
 extern void ClearImage();
 extern void ClearImageEx(color_t c);
@@ -28,8 +28,9 @@
 
 static void Initialize();
 static void Draw();
+static tick_t Prerender();
 
-application_t appclock = {.name="Clock", .init=Initialize, .draw=Draw};
+application_t appclock = {.name="Clock", .init=Initialize, .draw=Draw, .prerender=Prerender, .redraw=rdMinute};
 
 ////////// Variables ///////////////////////////////////////////////////////////
 
@@ -43,8 +44,7 @@ static void Initialize() {
 
 }
 
-// Called periodically when isForeground==true (30Hz)
-static void Draw() {
+static void DrawFace(timestamp_t now) {
     char s[50];
     int x,y,i;
     int cx, cy, r;
@@ -52,7 +52,6 @@ static void Draw() {
 
     //SetFontSize(2);
 
-    timestamp_t now = ClockNow();
     uint8 hour12 = ClockGet12Hour(now.hour);
     
     //// Analog Clock ////
@@ -139,3 +138,21 @@ static void Draw() {
     }
 
 }
+
+// Called on the minute while in the foreground (rdMinute), and after input
+static void Draw() {
+    DrawFace(ClockNow());
+}
+
+// Called when idle, draws the face for the start of the next minute
+static tick_t Prerender() {
+    timestamp_t next = ClockNow();
+    uint sec = next.sec;
+
+    next.sec = 0;
+    TimestampAddMinute(&next, 1);
+    DrawFace(next);
+
+    // Rounded up, so the frame is never shown early
+    return GetTicks() + SecondsToTicks(60 - sec);
+}
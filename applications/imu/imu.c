@@ -37,9 +37,9 @@
 ////////// App Definition //////////////////////////////////////////////////////
 
 static void Initialize();
-static void Process();
 static void Draw();
 static void Event(event_type_t type, uint param);
+static void Process();
 
 application_t appimu = {.name="IMU", .init=Initialize, .process=Process, .draw=Draw, .event=Event};
 
@@ -62,20 +62,21 @@ bool accel_initted = false;
 
 extern bool displayOn;
 
-static bool capturing = false;
+static volatile bool capturing = false;
+
+#define SAMPLE_INTERVAL 10
 
 ////////// Code ////////////////////////////////////////////////////////////////
 
+// The sampling task changes the accelerometer mode itself, so it's never
+// stopped part way through an I2C transfer
 static void StartCapture() {
-    accel_SetMode(accMeasure);
-    appimu.task->state = tsRun;
     capturing = true;
+    SetTaskState(appimu.task, tsRun);
 }
 
 static void StopCapture() {
-    appimu.task->state = tsStop;
     capturing = false;
-    accel_SetMode(accStandby);
 }
 
 // Called when CPU initializes 
@@ -92,25 +93,34 @@ static void Initialize() {
     StartCapture();
 }
 
-// Called periodically when state==asRunning
+// Samples every SAMPLE_INTERVAL while capturing, and is stopped otherwise.
+// The I2C reads busy-wait, so this stays in a low priority task.
 static void Process() {
     while (1) {
-        /*if (!accel_initted) {
-            accel_init();
-            accel_SetMode(accMeasure);
-            accel_initted = true;
-        }*/
+        // Stop until StartCapture (which can't slip in between checking and stopping)
+        uint ipl;
+        KernelEnterCritical(ipl);
+        if (!capturing)
+            SetTaskState(appimu.task, tsStop);
+        KernelExitCritical(ipl);
+        Delay(0);
 
-        Delay(10);
+        accel_SetMode(accMeasure);
 
-        //TODO: Shift accelerometer logging into the IMU API
+        while (capturing) {
+            Delay(SAMPLE_INTERVAL);
 
-        accel_vec = accel_ReadXYZ8();
-        accel_log[accel_log_index] = accel_vec;
+            //TODO: Shift accelerometer logging into the IMU API
+
+            accel_vec = accel_ReadXYZ8();
+            accel_log[accel_log_index] = accel_vec;
+
+            accel_log_index++;
+            if (accel_log_index == ACCEL_LOG_SIZE)
+                accel_log_index = 0;
+        }
 
-        accel_log_index++;
-        if (accel_log_index == ACCEL_LOG_SIZE)
-            accel_log_index = 0;
+        accel_SetMode(accStandby);
     }
 }
 
@@ -138,7 +148,7 @@ static void Event(event_type_t type, uint param) {
     }
 }
 
-// Called periodically when isForeground==true (30Hz)
+// Called while in the foreground, at the default frame rate (rdContinuous)
 static void Draw() {
 
 
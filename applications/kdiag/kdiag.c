@@ -12,22 +12,25 @@
 #include "api/app.h"
 #include "api/graphics/gfx.h"
 #include "util/util.h"
+#include "core/boot.h"
 
 ////////// App Definition //////////////////////////////////////////////////////
 
 static void Initialize();
 static void Draw();
+static void Event(event_type_t type, uint param);
 
-application_t appkdiag = {.name="K-Diag", .init=Initialize, .draw=Draw};
+application_t appkdiag = {.name="K-Diag", .init=Initialize, .draw=Draw, .event=Event, .redraw=rdSecond};
 
 ////////// Variables ///////////////////////////////////////////////////////////
 
-extern uint num_tasks;
-extern task_t tasks[];
-
 #define BASE_CURRENT 2      // 200uA CPI idle + 90mA OLED display
 #define CPU_CURRENT 160     // 16mA at full CPU speed
 
+typedef enum { pgUsage, pgLatency, pgBoot, NUM_PAGES } page_t;
+
+static page_t page = pgUsage;       // BTN1 cycles through the pages
+
 ////////// Code ////////////////////////////////////////////////////////////////
 
 // Called when CPU initializes 
@@ -39,8 +42,12 @@ static INLINE uint cpu_current(uint utilization) {
     return (utilization * CPU_CURRENT) / 1000;
 }
 
-// Called periodically when isForeground==true (30Hz)
-static void Draw() {
+static void Event(event_type_t type, uint param) {
+    if (type == evtBtnPress && (byte)param == 1)
+        page = (page + 1) % NUM_PAGES;
+}
+
+static void DrawUsage() {
     uint i, x, y;
     char s[20];
 
@@ -55,8 +62,8 @@ static void Draw() {
 
         DrawLine(x,128, x,(128-value), SKYBLUE);
 
-        if (i++ == CPU_TICK_HISTORY_LEN)
-            i -= CPU_TICK_HISTORY_LEN;
+        if (++i == CPU_TICK_HISTORY_LEN)
+            i = 0;
     }
 
     x = 0; y = 16;
@@ -66,36 +73,137 @@ static void Draw() {
 
     DrawString("CPU%", 60,y, WHITE);
     DrawString("mA", 85,y, WHITE);
+    DrawString("Stk", 105,y, WHITE);
     //DrawString("%CPU", 88,y, WHITE);
     y += 8;
 
     // NOTE: Starting at 1 to skip the Idle task
     for (i=1; i<num_tasks; i++) {
         task_t* task = &tasks[i];
+        if (task->state == tsFree)
+            continue;
 
-        color_t color = (task->state == tsRun) ? WHITE : GRAY;
+        color_t color = (task->state == tsRun || task->state == tsBlocked) ? WHITE : GRAY;
         
         DrawString(task->name, 8,y, color);
         
         //utoa(s, task->next_run, 10);
-        decitoa(s, task->cpu_ticks);
+        decitoa(s, task->cpu_usage);
         DrawString(s, 60,y, color);
 
-        decitoa(s, cpu_current(task->cpu_ticks));
+        decitoa(s, cpu_current(task->cpu_usage));
         DrawString(s, 85,y, color);
 
-        //utoa(s, task->cpu_usage, 10);
-        //DrawString(s, 88,y, color);
+        // Stack high-water mark (bytes)
+        utoa(s, KernelStackHighWater(task), 10);
+        DrawString(s, 105,y, color);
 
         y += 8;
     }
 
     DrawString("Total", 8,y, WHITE);
 
-    decitoa(s, total_cpu_ticks);
+    decitoa(s, total_cpu_usage);
+    DrawString(s, 60,y, WHITE);
+    y += 8;
+
+    DrawString("Sleep", 8,y, WHITE);
+    decitoa(s, sleep_usage);
     DrawString(s, 60,y, WHITE);
 
     //utoa(s, 0, 10);
     //DrawString(s, 88,y, WHITE);
 
 }
+
+static void DrawLatency() {
+    uint i, b, y;
+    char s[20];
+
+    y = 16;
+    DrawString("Wakeup Latency", 8,y, WHITE);
+    y += 12;
+
+    DrawString("Max", 50,y, WHITE);
+    DrawString("Hist", 80,y, WHITE);
+    y += 8;
+
+    // NOTE: Starting at 1 to skip the Idle task
+    for (i=1; i<num_tasks; i++) {
+        task_t* task = &tasks[i];
+        if (task->state == tsFree)
+            continue;
+
+        DrawString(task->name, 8,y, WHITE);
+
+        // Max latency in ms (T1 counts are 1/32768 s, 10000/32768 = 625/2048)
+        uint32 latency = task->max_latency * 625 / 2048;
+        if (latency > MAX_UINT16)
+            latency = MAX_UINT16;
+        decitoa(s, (uint)latency);
+        DrawString(s, 50,y, WHITE);
+
+        // One bar per log2 bucket, height is log2 of the count
+        for (b=0; b<LATENCY_BUCKETS; b++) {
+            uint count = task->latency[b];
+            uint h = 0;
+            while (count && h < 7) {
+                count >>= 1;
+                h++;
+            }
+            if (h)
+                DrawBox(80 + b*4, y+7-h, 3, h, SKYBLUE, SKYBLUE);
+        }
+
+        y += 8;
+    }
+}
+
+static void DrawBoot() {
+    uint i, y;
+    char s[20];
+
+    y = 16;
+    DrawString("Boot Timeline", 8,y, WHITE);
+    y += 12;
+
+    DrawString("ms", 90,y, WHITE);
+    y += 8;
+
+    // One row per stage, with its bar along the bottom. If there are more
+    // stages than fit on screen, the earliest ones are left off.
+    uint rows = (DISPLAY_HEIGHT - y) / 8;
+    uint first = (num_boot_stages > rows) ? num_boot_stages - rows : 0;
+
+    // Each bar runs from the end of the previous stage, scaled to the whole boot
+    uint32 total = (num_boot_stages) ? boot_stages[num_boot_stages-1].time : 0;
+    uint32 start = (first) ? boot_stages[first-1].time : 0;
+
+    for (i=first; i<num_boot_stages; i++) {
+        boot_stage_t* stage = &boot_stages[i];
+
+        DrawString(stage->name, 8,y, WHITE);
+
+        utoa(s, (uint)BootTimeMs(stage->time), 10);
+        DrawString(s, 90,y, WHITE);
+
+        if (total) {
+            uint x1 = start * 120 / total;
+            uint x2 = stage->time * 120 / total;
+            DrawBox(4 + x1, y+7, (x2 > x1) ? x2 - x1 : 1, 1, SKYBLUE, SKYBLUE);
+        }
+        start = stage->time;
+
+        y += 8;
+    }
+}
+
+// Called every second while in the foreground (rdSecond), and after input
+static void Draw() {
+    switch (page) {
+        case pgUsage: DrawUsage(); break;
+        case pgLatency: DrawLatency(); break;
+        case pgBoot: DrawBoot(); break;
+        default: break;
+    }
+}
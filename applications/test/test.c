@@ -35,7 +35,7 @@
 static void Initialize();
 static void Draw();
 
-application_t apptest = {.name="Test", .init=Initialize, .draw=Draw};
+application_t apptest = {.name="Test", .init=Initialize, .draw=Draw, .redraw=rdOnDemand};
 
 ////////// Variables ///////////////////////////////////////////////////////////
 extern task_t* draw_task;
@@ -96,7 +96,7 @@ static void DrawTestGradient() {
     return;
 }
 
-// Called periodically when isForeground==true (30Hz)
+// Called while in the foreground after input or a RequestRedraw (rdOnDemand)
 static void Draw() {
     
     //DrawTestGradient();
@@ -13,6 +13,8 @@
 #include "drivers/usb/usb.h"
 #include "background/comms.h"
 #include "core/kernel.h"
+#include "core/cpu.h"
+#include "core/boot.h"
 
 #include "usb_config.h"
 #include "./USB/usb.h"
@@ -28,10 +30,6 @@
 
 ////////// Defines /////////////////////////////////////////////////////////////
 
-// Run this as fast as possible, since usually it's only
-// checking if data is received and nothing else.
-#define PROCESS_COMMS_INTERVAL 25
-
 #define SetTxErrorCode(code) (tx_buffer[1] = code)
 
 ////////// Variables ///////////////////////////////////////////////////////////
@@ -65,8 +63,7 @@ void InitializeComms() {
     InitializeUSB(&comms_sleep, &comms_wake);
     
     // Communications, only needs to be run when USB is connected
-    comms_task = RegisterTask("Comms", ProcessComms);
-    comms_task->state = tsRun;
+    comms_task = RegisterTask("Comms", ProcessComms, prNormal, TASK_STACK_SIZE);
 
     usb_connected = false;
     comms_status = cmDisconnected;
@@ -74,7 +71,7 @@ void InitializeComms() {
 
 void comms_sleep() {
     // Called by the USB module when the USB becomes disconnected
-    comms_task->state = tsStop;
+    SetTaskState(comms_task, tsStop);
     usb_connected = false;
     comms_status = cmDisconnected;
 
@@ -84,7 +81,7 @@ void comms_sleep() {
 
 void comms_wake() {
     // Called by the USB module when the USB becomes connected
-    comms_task->state = tsRun;
+    SetTaskState(comms_task, tsRun);
     usb_connected = true;
     comms_status = cmIdle;
 
@@ -96,8 +93,9 @@ void ProcessComms() {
     while (1) {
         USBProcess(&comms_ReceivedPacket);
 
-        //TODO: Implement some sort of variable delay that waits for data transmission
-        Delay(1);
+        // Sleep until the host sends us something.
+        // (Connection timeouts are handled by the USB driver)
+        USBWait(WAIT_FOREVER);
     }
 }
 
@@ -158,8 +156,110 @@ void comms_ReceivedPacket(unsigned char* packet) {
             cpu_info_t* tx_packet = (cpu_info_t*)tx_buffer;
 
             // systick.h
-            tx_packet->systick = systick;
+            tx_packet->systick = GetTicks();
+
+            // cpu.h
+            tx_packet->cpu_clock = CpuFcy();
+
+            // kernel.h
+            uint i;
+            tx_packet->cpu_usage = total_cpu_usage;
+            tx_packet->sleep_usage = sleep_usage;
+            for (i=0; i<NUM_KERNEL_ISRS; i++)
+                tx_packet->isr_usage[i] = isr_usage[i];
+
+            break;
+        }
+
+        case CMD_GET_TASK_INFO:
+        {
+            task_info_packet_t* rx_packet = (task_info_packet_t*)packet;
+            task_info_packet_t* tx_packet = (task_info_packet_t*)tx_buffer;
+
+            uint16 index = rx_packet->index;
+            tx_packet->index = index;
+            tx_packet->num_tasks = num_tasks;
+
+            if (index >= num_tasks) {
+                SetTxErrorCode(ERR_INVALID_INDEX);
+                break;
+            }
+
+            // kernel.h
+            task_t* task = &tasks[index];
+            strncpy(tx_packet->name, task->name, TASK_NAME_LEN+1);
+            tx_packet->state = task->state;
+            tx_packet->priority = task->priority;
+            tx_packet->stack_size = task->stack_size;
+            tx_packet->stack_used = KernelStackHighWater(task);
+            tx_packet->cpu_usage = task->cpu_usage;
+
+            break;
+        }
+
+        case CMD_GET_TASK_LATENCY:
+        {
+            latency_packet_t* rx_packet = (latency_packet_t*)packet;
+            latency_packet_t* tx_packet = (latency_packet_t*)tx_buffer;
+
+            uint16 index = rx_packet->index;
+            bool clear = rx_packet->clear;
+            tx_packet->index = index;
+            tx_packet->num_tasks = num_tasks;
+            tx_packet->clear = clear;
+
+            if (index >= num_tasks) {
+                SetTxErrorCode(ERR_INVALID_INDEX);
+                break;
+            }
+
+            // kernel.h
+            task_t* task = &tasks[index];
+            uint i;
+            tx_packet->max_latency = task->max_latency;
+            for (i=0; i<LATENCY_BUCKETS; i++)
+                tx_packet->buckets[i] = task->latency[i];
+
+            if (clear)
+                KernelResetLatency(task);
+
+            break;
+        }
+
+        case CMD_GET_BOOT_STAGE:
+        {
+            boot_stage_packet_t* rx_packet = (boot_stage_packet_t*)packet;
+            boot_stage_packet_t* tx_packet = (boot_stage_packet_t*)tx_buffer;
+
+            uint16 index = rx_packet->index;
+            tx_packet->index = index;
+            tx_packet->num_stages = num_boot_stages;
 
+            if (index >= num_boot_stages) {
+                SetTxErrorCode(ERR_INVALID_INDEX);
+                break;
+            }
+
+            // boot.h
+            boot_stage_t* stage = &boot_stages[index];
+            strncpy(tx_packet->name, stage->name, BOOT_STAGE_NAME_LEN);
+            tx_packet->name[BOOT_STAGE_NAME_LEN] = '\0';
+            tx_packet->time = stage->time;
+
+            break;
+        }
+
+        case CMD_GET_TRACE:
+        {
+#ifdef KERNEL_TRACE
+            trace_packet_t* tx_packet = (trace_packet_t*)tx_buffer;
+
+            // kernel.h
+            tx_packet->count = KernelReadTrace(tx_packet->records, TRACE_PACKET_RECORDS);
+            tx_packet->dropped = trace_dropped;
+#else
+            SetTxErrorCode(ERR_NOT_IMPLEMENTED);
+#endif
             break;
         }
 
@@ -213,6 +313,7 @@ void comms_ReceivedPacket(unsigned char* packet) {
         case CMD_DISPLAY_UNLOCK:
         {
             lock_display = false;
+            RequestRedraw();    // Frames skipped while locked
             break;
         }
 
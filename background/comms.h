@@ -12,6 +12,7 @@
 #include "background/power_monitor.h"
 #include "api/clock.h"
 #include "api/calendar.h" // MAX_LABEL_LEN, MAX_LOCATION_LEN
+#include "core/kernel.h" // TASK_NAME_LEN
 
 #define CMD_PING                0x01
 #define CMD_RESET               0x02
@@ -21,6 +22,10 @@
 #define CMD_GET_BATTERY_INFO    0x10    // Battery voltage, VDD, levels, status
 #define CMD_GET_CPU_INFO        0x11    // Osc freq, systick, utilization, time spent in sleep
 #define CMD_GET_NEXT_MESSAGE    0x12    // Next debug message in the buffer
+#define CMD_GET_TASK_INFO       0x13    // Name, state, priority and stack usage of a kernel task
+#define CMD_GET_TRACE           0x14    // Next records in the kernel trace buffer (see KERNEL_TRACE)
+#define CMD_GET_TASK_LATENCY    0x15    // Wakeup latency histogram of a kernel task
+#define CMD_GET_BOOT_STAGE      0x16    // Name and finish time of a boot stage (see core/boot.h)
 
 // Display interface
 #define CMD_QUERY_DISPLAY       0x20    // Returns parameters of the display
@@ -87,10 +92,66 @@ typedef struct __attribute__((packed, __may_alias__)) {
     byte command;
     byte error;
 
-    uint16 systick;
-    //TODO: add more fields
+    uint32 systick;
+    uint32 cpu_clock;   // Instruction clock (Hz), see cpu_speed_t
+
+    // Utilization over the last CPU_USAGE_WINDOW (0.1% units)
+    uint16 cpu_usage;   // All tasks except idle
+    uint16 sleep_usage; // Sleep/Idle mode
+    uint16 isr_usage[NUM_KERNEL_ISRS];  // kernel_isr_t
 } cpu_info_t;
 
+typedef struct __attribute__((packed, __may_alias__)) {
+    byte command;
+    byte error;
+
+    uint16 index;
+    uint16 num_tasks;
+
+    char name[TASK_NAME_LEN+1];
+    byte state;         // task_state_t
+    byte priority;      // task_priority_t
+
+    uint16 stack_size;  // bytes
+    uint16 stack_used;  // high-water mark, bytes
+    uint16 cpu_usage;   // 0.1% units
+} task_info_packet_t;
+
+typedef struct __attribute__((packed, __may_alias__)) {
+    byte command;
+    byte error;
+
+    uint16 index;
+    uint16 num_tasks;
+    uint8 clear;        // Request: reset the histogram after reading it
+
+    uint32 max_latency; // T1 counts (1/32768 s)
+    uint16 buckets[LATENCY_BUCKETS]; // log2 histogram, see LATENCY_BUCKETS
+} latency_packet_t;
+
+#define BOOT_STAGE_NAME_LEN 16
+typedef struct __attribute__((packed, __may_alias__)) {
+    byte command;
+    byte error;
+
+    uint16 index;
+    uint16 num_stages;
+
+    char name[BOOT_STAGE_NAME_LEN+1];
+    uint32 time;        // T1 counts since InitializeKernel (1/32768 s)
+} boot_stage_packet_t;
+
+#define TRACE_PACKET_RECORDS 7
+typedef struct __attribute__((packed, __may_alias__)) {
+    byte command;
+    byte error;
+
+    uint8 count;        // Number of records in this packet (0 when the buffer is empty)
+    uint16 dropped;     // Total records lost because the buffer overflowed
+
+    trace_record_t records[TRACE_PACKET_RECORDS];
+} trace_packet_t;
+
 typedef struct __attribute__((packed, __may_alias__)) {
     byte command;
     byte error;
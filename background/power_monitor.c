@@ -20,6 +20,8 @@
 #include "hardware.h"
 #include "power_monitor.h"
 #include "peripherals/adc.h"
+#include "core/kernel.h"
+#include "background/comms.h"
 
 ////////// Defines /////////////////////////////////////////////////////////////
 
@@ -89,10 +91,39 @@ uint16 vbat_history[NUM_VBAT_SAMPLES];
 uint8 vbat_idx = 0;
 uint8 vbat_count = NUM_VBAT_SAMPLES-1;
 
+static soft_timer_t power_timer;
+static proc_t change_callback = NULL;
+static uint last_state;             // Status the callback last saw
+
 ////////// Methods /////////////////////////////////////////////////////////////
 
+static void power_timer_cb(uint param) {
+    ProcessPowerMonitor();
+}
+
 void InitializePowerMonitor() {
     // Battery voltage on AN_VBAT
+    TimerInit(&power_timer, power_timer_cb, 0);
+    TimerStart(&power_timer, 0, POWER_MONITOR_INTERVAL);
+}
+
+void PowerMonitorSetInterval(uint interval) {
+    if (power_timer.period != interval)
+        TimerStart(&power_timer, interval, interval);
+}
+
+void PowerMonitorSetCallback(proc_t callback) {
+    change_callback = callback;
+}
+
+static void CheckForChange() {
+    // Everything the status bar shows
+    uint state = battery_level | (battery_status << 7) | (power_status << 10) | ((uint)usb_connected << 12);
+    if (state != last_state) {
+        last_state = state;
+        if (change_callback != NULL)
+            change_callback();
+    }
 }
 
 void cb_ConvertedVBat(voltage_t voltage) {
@@ -131,6 +162,8 @@ void cb_ConvertedVBat(voltage_t voltage) {
        else
            battery_status = batNormal;
     }
+
+    CheckForChange();
 }
 
 void ProcessPowerMonitor() {
@@ -53,9 +53,17 @@ extern uint battery_level;
 extern const char* power_status_message[];
 extern const char* battery_status_message[];
 
+#define POWER_MONITOR_INTERVAL 50   // Default update rate (systicks)
+
 ////////// Methods /////////////////////////////////////////////////////////////
 
+// Runs ProcessPowerMonitor periodically from a kernel software timer
 void InitializePowerMonitor();
+void PowerMonitorSetInterval(uint interval);
+
+// Called from the kernel's worker task when the power status, battery status
+// or battery level changes
+void PowerMonitorSetCallback(proc_t callback);
 void ProcessPowerMonitor();
 //uint8 GetChargeStatus();
 
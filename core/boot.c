@@ -0,0 +1,44 @@
+/*
+ * File:   boot.c
+ * Author: Jared
+ *
+ * Boot profiler (see boot.h)
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#include "system.h"
+#include "core/kernel.h"
+#include "core/boot.h"
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+boot_stage_t boot_stages[MAX_BOOT_STAGES];
+uint num_boot_stages = 0;
+bool boot_done = false;
+
+////////// Code ////////////////////////////////////////////////////////////////
+
+static void RecordStage(const char* name, uint max_stages, bool done) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (!boot_done && num_boot_stages < max_stages) {
+        boot_stage_t* stage = &boot_stages[num_boot_stages++];
+        stage->name = name;
+        stage->time = KernelBootTimestamp();
+    }
+    if (done)
+        boot_done = true;
+
+    KernelExitCritical(ipl);
+}
+
+void BootStage(const char* name) {
+    // Always leave room for "Done"
+    RecordStage(name, MAX_BOOT_STAGES-1, false);
+}
+
+void BootDone() {
+    RecordStage("Done", MAX_BOOT_STAGES, true);
+}
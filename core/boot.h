@@ -0,0 +1,36 @@
+/*
+ * File:   boot.h
+ * Author: Jared
+ *
+ * Boot profiler. Records when each stage of the boot finished, on the
+ * kernel's boot timer (see KernelBootTimestamp), so the timeline can be shown
+ * on screen (K-Diag) and read over USB (CMD_GET_BOOT_STAGE).
+ */
+
+#ifndef BOOT_H
+#define	BOOT_H
+
+#include "core/kernel.h"
+
+#define MAX_BOOT_STAGES 16
+
+typedef struct {
+    const char* name;
+    uint32 time;        // T1 counts since InitializeKernel (1/32768 s)
+} boot_stage_t;
+
+// Record that the named stage has just finished. Safe to call from any task,
+// and before KernelStart. Ignored once the boot is done, or past MAX_BOOT_STAGES.
+extern void BootStage(const char* name);
+
+// Record the final stage ("Done"), later calls to BootStage are ignored
+extern void BootDone();
+
+// Time since InitializeKernel in ms
+#define BootTimeMs(time) ((uint32)(time) * 125 / 4096)  // 1000/32768
+
+extern boot_stage_t boot_stages[MAX_BOOT_STAGES];
+extern uint num_boot_stages;
+extern bool boot_done;
+
+#endif	/* BOOT_H */
@@ -10,6 +10,9 @@
 #include <system.h>
 #include "cpu.h"
 #include "hardware.h"
+#include "core/kernel.h"
+#include "peripherals/i2c.h"
+#include "drivers/ssd1351.h"
 
 // Sleep mode stops clock operation and halts all code execution
 // Idle mode halts the CPU and code execution, but allows peripheral
@@ -20,6 +23,16 @@
 // when the device wakes back up. Would only be suitable for long sleeps
 // (~1 second sleeps?)
 
+////////// Variables ///////////////////////////////////////////////////////////
+
+cpu_speed_t cpu_speed = cpu32MHz;
+
+static uint boost_count = 0;
+
+static soft_timer_t governor_timer;
+static uint32 governor_time;
+static uint32 governor_idle_time;
+
 ////////// Methods /////////////////////////////////////////////////////////////
 
 void InitializeIO() {
@@ -126,7 +139,8 @@ void InitializeIO() {
 
 void InitializeOsc() {
 
-    _CPDIV = 0b00; //CPU prescaler
+    _CPDIV = cpu32MHz; //CPU prescaler
+    cpu_speed = cpu32MHz;
 
  	//On the PIC24FJ64GB004 Family of USB microcontrollers, the PLL will not power up and be enabled
 	//by default, even if a PLL enabled oscillator configuration is selected (such as HS+PLL).
@@ -141,6 +155,75 @@ void InitializeOsc() {
     }
 }
 
+void CpuSetSpeed(cpu_speed_t speed) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (speed != cpu_speed) {
+        // Keep the I2C bus at or below its rated clock during the change,
+        // so update the baud rate before speeding up, or after slowing down.
+        if (speed < cpu_speed) {
+            i2c_set_clock((uint32)(POSC/2) >> speed);
+            _CPDIV = speed;
+        } else {
+            _CPDIV = speed;
+            i2c_set_clock((uint32)(POSC/2) >> speed);
+        }
+        cpu_speed = speed;
+    }
+
+    KernelExitCritical(ipl);
+}
+
+void CpuBoostBegin() {
+    uint ipl;
+    KernelEnterCritical(ipl);
+    boost_count++;
+    CpuSetSpeed(cpu32MHz);
+    KernelExitCritical(ipl);
+}
+
+void CpuBoostEnd() {
+    // The governor will lower the speed again if there's nothing to do
+    uint ipl;
+    KernelEnterCritical(ipl);
+    if (boost_count)
+        boost_count--;
+    KernelExitCritical(ipl);
+}
+
+static void CpuGovernor(uint param) {
+    // Utilization since the last adjustment (everything but the idle task)
+    uint32 now = KernelTimestamp();
+    uint32 idle_time = KernelIdleTime();
+    uint32 elapsed = now - governor_time;
+    uint32 idle = idle_time - governor_idle_time;
+    governor_time = now;
+    governor_idle_time = idle_time;
+
+    uint usage = 0;
+    if (elapsed > idle)
+        usage = (elapsed - idle) * 1000 / elapsed;
+
+    if (boost_count || USB_VBUS_SENSE) {
+        // USB needs the full clock while attached
+        CpuSetSpeed(cpu32MHz);
+    } else if (usage > CPU_GOVERNOR_UP) {
+        CpuSetSpeed(cpu32MHz);
+    } else if (usage < CPU_GOVERNOR_DOWN && cpu_speed < cpu4MHz) {
+        // Halving the speed will roughly double the utilization
+        CpuSetSpeed(cpu_speed + 1);
+    }
+}
+
+void InitializeCpuGovernor() {
+    governor_time = KernelTimestamp();
+    governor_idle_time = KernelIdleTime();
+
+    TimerInit(&governor_timer, CpuGovernor, 0);
+    TimerStart(&governor_timer, CPU_GOVERNOR_INTERVAL, CPU_GOVERNOR_INTERVAL);
+}
+
 void Shutdown() {
     // Stop execution and completely shut down the processor to save power.
 
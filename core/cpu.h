@@ -19,9 +19,35 @@ typedef enum {
 } cpu_state_t;
 extern cpu_state_t cpu_state;
 
+// CPU clock speed, the value is the CPDIV postscaler applied to the 32MHz PLL branch
+typedef enum {
+    cpu32MHz = 0,
+    cpu16MHz = 1,
+    cpu8MHz = 2,
+    cpu4MHz = 3
+} cpu_speed_t;
+extern cpu_speed_t cpu_speed;
+
+// Instruction clock for the current speed (peripheral clock)
+#define CpuFcy() ((uint32)(POSC/2) >> cpu_speed)
+
+// The governor picks the CPU speed from the measured utilization
+#define CPU_GOVERNOR_INTERVAL 100   // systicks between adjustments
+#define CPU_GOVERNOR_UP 600         // Go to full speed above this utilization (0.1%)
+#define CPU_GOVERNOR_DOWN 200       // Halve the speed below this utilization (0.1%)
+
 extern void InitializeIO();
 extern void InitializeOsc();
 
+// Start adjusting the CPU speed automatically (needs the kernel)
+extern void InitializeCpuGovernor();
+extern void CpuSetSpeed(cpu_speed_t speed);
+
+// Run at full speed between Begin and End (eg. pushing a frame to the display).
+// Calls may be nested.
+extern void CpuBoostBegin();
+extern void CpuBoostEnd();
+
 extern void WatchSleep();
 
 #endif	/* CPU_H */
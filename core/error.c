@@ -21,8 +21,6 @@ extern task_t* current_task;
 
 static bool in_error = false;
 
-//TODO: What happens with the stack when the stack trap is called???
-
 void CriticalError(const char* msg) {
     // Display a blue screen of death
 
@@ -32,6 +30,7 @@ void CriticalError(const char* msg) {
     T1CONbits.TON = 0;
     RCONbits.SWDTEN = 0;
 
+    DrawToOffscreen(false); // In case it happened during a pre-render
     ClearImageEx(SKYBLUE);
     SetFontSize(2);
     DrawString("CRITICAL", 8,8, HEXCOLOR32(0xFF2211));
@@ -43,7 +42,8 @@ void CriticalError(const char* msg) {
 
     // Gather some kernel diagnostics
     DrawString("Task:", 8,58, WHITE);
-    DrawString(task->name, 45,58, WHITE);
+    if (task != NULL)
+        DrawString(task->name, 45,58, WHITE);
     UpdateDisplay();
 
     while (!_PORT(BTN1) && !_PORT(BTN2) && !_PORT(BTN3) && !_PORT(BTN4));
@@ -67,8 +67,10 @@ void isr _AddressError() {
     CriticalError("Trap: Address Error");
 }
 
-void isr _StackError() {
-    CriticalError("Trap: Stack Error");
+// Called by the _StackError trap (see kernel_asm.s) once it has
+// switched to a safe stack. current_task is the task that overflowed.
+void KernelStackError() {
+    CriticalError("Trap: Stack Overflow");
 }
 
 void isr _MathError() {
@@ -0,0 +1,147 @@
+/*
+ * File:   input.c
+ * Author: Jared
+ *
+ * Button input queue (see input.h)
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#include "system.h"
+#include "core/kernel.h"
+#include "core/input.h"
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+typedef struct {
+    uint8 btn;
+    bool pressed;
+    tick_t time;
+} input_edge_t;
+
+typedef struct {
+    bool pressed;       // Debounced state
+    bool long_pressed;  // evtBtnLongPress has been sent for this press
+    tick_t time;        // Last accepted change
+    tick_t next_tick;   // Next evtBtnLongPress or evtBtnRepeat, while pressed
+} button_t;
+
+// Single producer, single consumer: the interrupt only moves the head and the
+// core task only moves the tail, so neither side needs a critical section
+static volatile input_edge_t queue[INPUT_QUEUE_LEN];
+static volatile uint queue_head = 0;
+static volatile uint queue_tail = 0;
+
+// Latest raw state of each button, so a dropped or debounced edge can't leave
+// a button stuck
+static volatile bool raw_state[NUM_BUTTONS+1];
+
+static button_t buttons[NUM_BUTTONS+1];
+
+static event_flags_t* wake_events = NULL;
+static uint wake_flag;
+
+uint input_dropped = 0;
+
+////////// Code ////////////////////////////////////////////////////////////////
+
+void InitializeInput(event_flags_t* ev, uint flag) {
+    wake_events = ev;
+    wake_flag = flag;
+}
+
+void InputButtonChange(uint btn, bool pressed) {
+    raw_state[btn] = pressed;
+
+    uint next = (queue_head + 1) & (INPUT_QUEUE_LEN - 1);
+    if (next != queue_tail) {
+        volatile input_edge_t* edge = &queue[queue_head];
+        edge->btn = btn;
+        edge->pressed = pressed;
+        edge->time = GetTicks();
+        queue_head = next;
+    } else {
+        input_dropped++;
+    }
+
+    if (wake_events != NULL)
+        EventFlagsSet(wake_events, wake_flag);
+}
+
+// Apply a change to the debounced state, returns false if it's not a change
+// or it's bounce
+static bool Change(uint btn, bool pressed, tick_t time, input_event_t* evt) {
+    button_t* b = &buttons[btn];
+    if (pressed == b->pressed || TickDiff(time, b->time) < DEBOUNCE_INTERVAL)
+        return false;
+
+    b->pressed = pressed;
+    b->long_pressed = false;
+    b->time = time;
+    b->next_tick = time + LONG_PRESS_INTERVAL;
+
+    evt->type = (pressed) ? evtBtnPress : evtBtnRelease;
+    evt->btn = btn;
+    evt->time = time;
+    return true;
+}
+
+bool InputRead(input_event_t* evt) {
+    // Edges from the interrupt, oldest first
+    while (queue_tail != queue_head) {
+        input_edge_t edge = queue[queue_tail];
+        queue_tail = (queue_tail + 1) & (INPUT_QUEUE_LEN - 1);
+        if (Change(edge.btn, edge.pressed, edge.time, evt))
+            return true;
+    }
+
+    tick_t now = GetTicks();
+    uint btn;
+    for (btn=1; btn<=NUM_BUTTONS; btn++) {
+        button_t* b = &buttons[btn];
+
+        // A change that was dropped, or came too soon after the last one
+        if (raw_state[btn] != b->pressed) {
+            if (Change(btn, raw_state[btn], now, evt))
+                return true;
+            continue;
+        }
+
+        if (b->pressed && TickDiff(now, b->next_tick) >= 0) {
+            evt->type = (b->long_pressed) ? evtBtnRepeat : evtBtnLongPress;
+            evt->btn = btn;
+            evt->time = b->next_tick;
+            b->long_pressed = true;
+
+            // Skip repeats that were missed rather than sending them all at once
+            b->next_tick += REPEAT_INTERVAL;
+            if (TickDiff(now, b->next_tick) >= 0)
+                b->next_tick = now + REPEAT_INTERVAL;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint InputTimeout(uint timeout) {
+    tick_t now = GetTicks();
+    uint btn;
+    for (btn=1; btn<=NUM_BUTTONS; btn++) {
+        button_t* b = &buttons[btn];
+        tick_t due;
+        if (raw_state[btn] != b->pressed)
+            due = b->time + DEBOUNCE_INTERVAL;
+        else if (b->pressed)
+            due = b->next_tick;
+        else
+            continue;
+
+        int32 ticks = TickDiff(due, now);
+        if (ticks <= 0)
+            return 0;
+        if (ticks < timeout)
+            timeout = ticks;
+    }
+    return timeout;
+}
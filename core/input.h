@@ -0,0 +1,46 @@
+/*
+ * File:   input.h
+ * Author: Jared
+ *
+ * Button input queue. The pin-change interrupt only timestamps each edge
+ * and adds it to a lock-free ring (InputButtonChange), the core task reads
+ * them back as debounced events (InputRead), with long-press and
+ * auto-repeat worked out from the timestamps.
+ */
+
+#ifndef INPUT_H
+#define	INPUT_H
+
+#include "core/kernel.h"
+#include "api/app.h"
+
+#define NUM_BUTTONS 4           // Numbered from 1
+
+#define INPUT_QUEUE_LEN 16      // Edges waiting for the core task (power of 2)
+#define DEBOUNCE_INTERVAL 25    // Changes this soon after the last one are bounce (systicks)
+#define LONG_PRESS_INTERVAL 600 // Held this long for evtBtnLongPress (systicks)
+#define REPEAT_INTERVAL 150     // Then evtBtnRepeat this often while held (systicks)
+
+typedef struct {
+    event_type_t type;  // evtBtnPress, evtBtnRelease, evtBtnLongPress or evtBtnRepeat
+    uint8 btn;
+    tick_t time;        // When the edge happened (or the button had been held until)
+} input_event_t;
+
+// Set 'flag' in 'ev' whenever there's something for InputRead
+extern void InitializeInput(event_flags_t* ev, uint flag);
+
+// Queue a button edge. Called from the pin-change interrupt.
+extern void InputButtonChange(uint btn, bool pressed);
+
+// Read the next input event, returns false if there isn't one yet.
+// Only one task may read.
+extern bool InputRead(input_event_t* evt);
+
+// Limit a timeout to when InputRead will next have something to report
+// (a long-press or repeat coming up, or a change waiting out its debounce)
+extern uint InputTimeout(uint timeout);
+
+extern uint input_dropped;      // Edges lost to a full queue (the final state still gets through)
+
+#endif	/* INPUT_H */
@@ -9,12 +9,14 @@
 
 #include <timer.h>
 #include <stdlib.h>
+#include <string.h>
 #include "system.h"
 #include "core/kernel.h"
 #include "core/cpu.h"
 #include "kernel.h"
 #include "hardware.h"
 #include "background/comms.h"
+#include "core/error.h"
 
 ////////// Variables ///////////////////////////////////////////////////////////
 
@@ -23,19 +25,78 @@ task_t tasks[MAX_TASKS] __attribute__((section(".data.tasks")));
 uint num_tasks = 0;
 uint anext_task = MAX_UINT;
 task_t* current_task;
-uint current_task_index = 0;
 
 uint16 stack_base = 0;
 uint16 current_stack_base = 0;
+uint16 stack_limit = 0;
 uint16 task_sp = 0;
 //uint16 kernel_sp = 0;
 
 task_t* idle_task;
+task_t* work_task;
 extern task_t* draw_task;
 extern task_t* core_task;
 
-uint cpu_tick_counter = 0;
-uint total_cpu_ticks = 0;
+// Run queues, one per priority level. Bit n of ready_bitmap is set
+// if there is at least one task in ready_head[n].
+static task_t* ready_head[NUM_PRIORITIES];
+static task_t* ready_tail[NUM_PRIORITIES];
+static uint ready_bitmap = 0;
+
+// Running tasks that are waiting for their next_run, sorted by next_run
+// (earliest first) so only the head needs to be checked each systick.
+static task_t* sleep_list = NULL;
+
+// Deferred work, posted by interrupts and run by the worker task
+typedef struct {
+    work_proc_t proc;
+    uint param;
+} work_item_t;
+
+static work_item_t work_buffer[WORK_QUEUE_LEN];
+static queue_t work_queue;
+
+// Stacks released by deleted tasks (size 0 = unused entry)
+typedef struct {
+    uint16 base;
+    uint16 size;
+} stack_block_t;
+
+static stack_block_t stack_pool[MAX_TASKS];
+
+// Smaller leftovers are handed out with the stack instead of being split off
+#define STACK_MIN_BLOCK 64
+
+// Active software timers, sorted by deadline
+static soft_timer_t* timer_list = NULL;
+
+static coroutine_t coroutines[MAX_COROUTINES];
+static uint num_coroutines = 0;
+
+static idle_hook_t idle_hook = NULL;
+
+#ifdef KERNEL_TRACE
+static trace_record_t trace_buffer[TRACE_BUFFER_LEN];
+static uint trace_head = 0;     // Index of the oldest record
+static uint trace_count = 0;
+uint trace_dropped = 0;         // Records overwritten before they could be read
+#endif
+
+// CPU accounting, all times are in T1 counts (see KernelTimestamp())
+static uint32 last_switch_time = 0;
+static uint32 window_start_time = 0;
+static uint32 isr_time_since_switch = 0;    // Not counted against the current task
+
+static uint32 sleep_time = 0;
+static uint32 window_sleep_time = 0;
+
+static uint32 isr_start_time[NUM_KERNEL_ISRS];
+static uint32 isr_time[NUM_KERNEL_ISRS];
+static uint32 window_isr_time[NUM_KERNEL_ISRS];
+
+uint total_cpu_usage = 0;
+uint sleep_usage = 0;
+uint isr_usage[NUM_KERNEL_ISRS];
 
 uint cpu_tick_history_idx = 0;
 uint cpu_tick_history[CPU_TICK_HISTORY_LEN];
@@ -43,6 +104,10 @@ uint cpu_tick_history[CPU_TICK_HISTORY_LEN];
 ////////// Prototypes //////////////////////////////////////////////////////////
 
 void KernelIdleTask();
+void KernelWorkTask();
+void KernelTaskExit();
+static uint TimerWaitTicks();
+static void TimerService();
 void KernelProcess();
 
 // Defined in kernel.s
@@ -51,7 +116,31 @@ extern void KernelStartContext();
 extern void KernelInitTaskStack(task_t* sp, task_proc_t proc);
 extern void KernelStartTask(task_t* sp);
 
-#define KernelSwitchToTask(task) current_task = task; task->ticks++
+static void KernelRecordLatency(task_t* task, uint32 latency);
+
+static INLINE void KernelSwitchToTask(task_t* task) {
+    // Time since the task was woken (last_switch_time is the time of this switch)
+    if (task->wake_pending) {
+        task->wake_pending = false;
+        KernelRecordLatency(task, last_switch_time - task->wake_time);
+    }
+
+    if (task != current_task)
+        KernelTrace(trSwitch, task - tasks, 0);
+    current_task = task;
+    task->ticks++;
+}
+
+// Index of the highest set bit (x must be non-zero)
+#ifdef __XC16__
+#define HighestBit(x) (16 - __builtin_ff1l(x))
+#else
+static INLINE uint HighestBit(uint x) {
+    uint i = 15;
+    while (!(x & (1 << i))) i--;
+    return i;
+}
+#endif
 
 ////////// Code ////////////////////////////////////////////////////////////////
 
@@ -61,13 +150,44 @@ extern void KernelStartTask(task_t* sp);
 #error SYSTICK too small
 #endif
 
+#if defined(KERNEL_TICKLESS) && (TICKLESS_MAX_TICKS * SYSTICK_TMR_PERIOD > 0xFFFF)
+#error TICKLESS_MAX_TICKS too big
+#endif
+
+
+// Incremented by the T1 ISR (see kernel_asm.s). Use GetTicks() to read it from a task.
+volatile tick_t __attribute__((near)) systick = 1;
+
+// The T1 ISR only calls the scheduler once systick reaches next_switch_tick,
+// or if the run queues have changed since it last ran (see kernel_asm.s).
+volatile tick_t __attribute__((near)) next_switch_tick = 0;
+volatile uint __attribute__((near)) resched_pending = 1;
+
+#ifdef KERNEL_TICKLESS
+// Number of systicks the current T1 period spans (0 when ticking normally).
+// Set by the idle task before it goes to sleep.
+static volatile uint tickless_ticks = 0;
+#endif
+
+// Until KernelStart, T1 free-runs with no interrupt to time the boot
+// (see KernelBootTimestamp)
+static bool kernel_started = false;
+static uint32 boot_epoch = 0;   // T1 rollovers counted so far, in T1 counts
+static uint32 boot_time = 0;    // KernelBootTimestamp() - KernelTimestamp() once started
 
-volatile uint __attribute__((near)) systick = 1;
+static void boot_timer_init() {
+    _T1MD = 0; // Enable T1 peripheral
+
+    T1CON =  T1_OFF & T1_IDLE_CON & T1_GATE_OFF & T1_PS_1_1 & T1_SYNC_EXT_OFF & T1_SOURCE_EXT;
 
-// Note: since we want to stop the systick interrupt from waking the CPU
-// out of sleep mode, we'll need to add the number of ticks spent sleeping somehow?
-// or maybe turn down the timer rate while it sleeps in case an asynchronous interrupt
-// wakes the processor (eg. accelerometer interrupt)
+    TMR1 = 0x0000;
+    PR1 = 0xFFFF;   // Rolls over every 2s
+
+    _T1IF = 0;
+    _T1IE = 0;
+
+    T1CONbits.TON = 1;
+}
 
 void systick_init() {
     // Configure a system tick timer with interrupt
@@ -80,7 +200,7 @@ void systick_init() {
     T1CON =  T1_OFF & T1_IDLE_CON & T1_GATE_OFF & T1_PS_1_1 & T1_SYNC_EXT_OFF & T1_SOURCE_EXT;
 
     TMR1 = 0x0000;
-    PR1 = 32;  // 32.768kHz / 32 = 1024Hz = 1 tick per 976ms
+    PR1 = SYSTICK_TMR_PR;  // 32.768kHz / 32 = 1024Hz = 1 tick per 976ms
 
     _T1IF = 0;
     _T1IP = 1; // Low priority so it doesn't pre-empt other interrupts
@@ -90,60 +210,505 @@ void systick_init() {
 }
 
 void InitializeKernel(void) {
-    current_stack_base = stack_base;
+    boot_timer_init();
+
+    // Task stacks are allocated upwards from the end of main()'s stack,
+    // up to the stack limit set by the C runtime.
+    current_stack_base = stack_base + KERNEL_STACK_RESERVE;
+    stack_limit = SPLIM;
 
     // IMPORTANT: The idle task MUST be the first task registered,
     //  and its state MUST be set to tsStop.
-    idle_task = RegisterTask("idle", KernelIdleTask);
-    idle_task->state = tsStop;
+    //  (It is run whenever the run queues are empty)
+    idle_task = RegisterTask("idle", KernelIdleTask, prIdle, TASK_STACK_SIZE);
+    SetTaskState(idle_task, tsStop);
+
+    QueueInit(&work_queue, work_buffer, sizeof(work_item_t), WORK_QUEUE_LEN);
+    work_task = RegisterTask("Work", KernelWorkTask, prRealtime, TASK_STACK_SIZE);
+}
+
+////////// Run Queues //////////////////////////////////////////////////////////
+// NOTE: Must be called from within a critical section
+
+static void ReadyPush(task_t* task) {
+    // Append to the back of the task's run queue
+    uint pr = task->priority;
+    task->next = NULL;
+    task->ready = true;
+    if (ready_head[pr] == NULL)
+        ready_head[pr] = task;
+    else
+        ready_tail[pr]->next = task;
+    ready_tail[pr] = task;
+    ready_bitmap |= (1 << pr);
+    resched_pending = 1;
+}
+
+static void ReadyRemove(task_t* task) {
+    uint pr = task->priority;
+    task_t* prev = NULL;
+    task_t* t = ready_head[pr];
+    while (t != NULL && t != task) {
+        prev = t;
+        t = t->next;
+    }
+    if (t == NULL)
+        return;
+
+    if (prev == NULL)
+        ready_head[pr] = task->next;
+    else
+        prev->next = task->next;
+    if (ready_tail[pr] == task)
+        ready_tail[pr] = prev;
+    if (ready_head[pr] == NULL)
+        ready_bitmap &= ~(1 << pr);
+
+    task->next = NULL;
+    task->ready = false;
+}
+
+static void SleepPush(task_t* task) {
+    // Insert after any tasks that are due at or before this one
+    task_t** t = &sleep_list;
+    while (*t != NULL && TickDiff((*t)->next_run, task->next_run) <= 0)
+        t = &(*t)->next;
+
+    task->ready = false;
+    task->next = *t;
+    *t = task;
+    resched_pending = 1; // May be due before next_switch_tick
+}
+
+static void SleepRemove(task_t* task) {
+    task_t** t = &sleep_list;
+    while (*t != NULL) {
+        if (*t == task) {
+            *t = task->next;
+            task->next = NULL;
+            return;
+        }
+        t = &(*t)->next;
+    }
+}
+
+static void WaitListRemove(task_t* task) {
+    task_t** t = task->wait_list;
+    while (*t != NULL) {
+        if (*t == task) {
+            *t = task->wait_next;
+            break;
+        }
+        t = &(*t)->wait_next;
+    }
+    task->wait_list = NULL;
+    task->wait_next = NULL;
+}
+
+static void ScheduleTask(task_t* task) {
+    // Queue a running task depending on whether it is due yet
+    if (TickDiff(systick, task->next_run) >= 0)
+        ReadyPush(task);
+    else
+        SleepPush(task);
+}
+
+static void UnscheduleTask(task_t* task) {
+    if (task->ready) {
+        ReadyRemove(task);
+    } else {
+        SleepRemove(task);
+        if (task->wait_list != NULL)
+            WaitListRemove(task);
+    }
+}
+
+static INLINE void MarkWake(task_t* task, uint32 time) {
+    // Remember when the task became due, to measure its wakeup latency
+    task->wake_time = time;
+    task->wake_pending = true;
+}
+
+static void UnblockTask(task_t* task) {
+    MarkWake(task, KernelTimestamp());
+    UnscheduleTask(task);
+    task->state = tsRun;
+    ReadyPush(task);
+}
+
+static void WakeSleepingTasks() {
+    // Move any sleeping tasks that are now due into their run queues
+    while (sleep_list != NULL && TickDiff(systick, sleep_list->next_run) >= 0) {
+        task_t* task = sleep_list;
+        sleep_list = task->next;
+        if (task->state == tsBlocked) {
+            // Timed out waiting
+            WaitListRemove(task);
+            task->wait_timed_out = true;
+            task->state = tsRun;
+        }
+        MarkWake(task, task->next_run * SYSTICK_TMR_PERIOD);
+        ReadyPush(task);
+    }
+}
+
+////////// Tasks ///////////////////////////////////////////////////////////////
+
+static uint16 KernelAllocStack(uint16* size) {
+    // Returns the base of a free stack of at least size bytes (or 0 if there isn't one).
+    // Uses the best fitting stack released by a deleted task, otherwise takes a new one.
+    stack_block_t* best = NULL;
+    uint i;
+    for (i=0; i<MAX_TASKS; i++) {
+        stack_block_t* block = &stack_pool[i];
+        if (block->size >= *size && (best == NULL || block->size < best->size))
+            best = block;
+    }
+
+    uint16 base;
+    if (best != NULL) {
+        base = best->base;
+        if (best->size - *size >= STACK_MIN_BLOCK) {
+            best->base += *size;
+            best->size -= *size;
+        } else {
+            *size = best->size;
+            best->size = 0;
+        }
+        return base;
+    }
+
+    if (current_stack_base > stack_limit || *size > stack_limit - current_stack_base)
+        return 0;
+
+    base = current_stack_base;
+    current_stack_base += *size;
+    return base;
+}
+
+static void KernelFreeStack(uint16 base, uint16 size) {
+    // Merge with any free neighbours
+    uint i;
+    for (i=0; i<MAX_TASKS; i++) {
+        stack_block_t* block = &stack_pool[i];
+        if (block->size == 0)
+            continue;
+
+        if (block->base + block->size == base) {
+            base = block->base;
+            size += block->size;
+            block->size = 0;
+        } else if (base + size == block->base) {
+            size += block->size;
+            block->size = 0;
+        }
+    }
+
+    // Give the top stack back to the unallocated space
+    if (base + size == current_stack_base) {
+        current_stack_base = base;
+        return;
+    }
+
+    for (i=0; i<MAX_TASKS; i++) {
+        if (stack_pool[i].size == 0) {
+            stack_pool[i].base = base;
+            stack_pool[i].size = size;
+            return;
+        }
+    }
+    // Pool is full (can't happen with MAX_TASKS entries), the stack is lost
 }
 
-task_t* RegisterTask(char* name, task_proc_t proc) {
-    task_t* task = &tasks[num_tasks++];
+task_t* RegisterTask(char* name, task_proc_t proc, task_priority_t priority, uint16 stack_size) {
+    if (stack_size == 0)
+        stack_size = TASK_STACK_SIZE;
+    stack_size = (stack_size + 1) & ~1; // Keep the stack word-aligned
+
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    // Reuse the slot of a deleted task if there is one
+    uint i;
+    task_t* task = NULL;
+    for (i=0; i<num_tasks; i++) {
+        if (tasks[i].state == tsFree) {
+            task = &tasks[i];
+            break;
+        }
+    }
+    if (task == NULL && num_tasks < MAX_TASKS)
+        task = &tasks[num_tasks++];
+
+    uint16 base = 0;
+    if (task != NULL) {
+        base = KernelAllocStack(&stack_size);
+        if (base == 0) {
+            task->state = tsFree;
+            if (task == &tasks[num_tasks-1])
+                num_tasks--;
+        } else {
+            task->state = tsStop; // Reserve the slot
+        }
+    }
+
+    KernelExitCritical(ipl);
+
+    if (task == NULL || base == 0) {
+        // Tasks registered at startup are required
+        if (current_task == NULL)
+            CriticalError((task == NULL) ? "Too many tasks" : "Out of stack space");
+        return NULL;
+    }
 
     // Assign some stack space to this task
-    current_stack_base += TASK_STACK_SIZE;
-    task->sp = current_stack_base;
-    task->stack_base = current_stack_base;
-    task->stack_size = TASK_STACK_SIZE;
-    
-	uint i=0;
+    task->sp = base;
+    task->stack_base = base;
+    task->stack_size = stack_size;
+    task->splim = base + stack_size - STACK_GUARD;
+
 	for (i=0; i<TASK_NAME_LEN && *name; i++)
 		task->name[i] = *name++;
-    task->name[TASK_NAME_LEN] = '\0';
+    task->name[i] = '\0';
 
     task->proc = proc;
-    task->state = tsRun;
+    task->priority = priority;
+    task->wait_list = NULL;
+    task->wait_next = NULL;
 
     task->ticks = 0;
     task->next_run = 0;
-    task->cpu_ticks = 0;
+    task->run_time = 0;
+    task->window_run_time = 0;
     task->cpu_usage = 0;
+    task->wake_pending = false;
+    KernelResetLatency(task);
 
     //task->cpu_history_idx = 0;
 
+    // Paint the stack so we can tell how much of it has been used
+    uint16* stack = KernelStackPtr(task->stack_base);
+    uint16 n;
+    for (n=0; n<stack_size/2; n++)
+        stack[n] = STACK_CANARY;
+
+    // Interrupts must be off while the stack pointer is moved to the new stack
+    KernelEnterCritical(ipl);
     KernelInitTaskStack(task, task->proc);
+    task->state = tsRun;
+    ScheduleTask(task);
+    KernelExitCritical(ipl);
 
     return task;
 }
 
-void fix_rollover(uint last_tick) {
+void DeleteTask(task_t* task) {
+    // The kernel's own tasks can't be deleted
+    if (task == idle_task || task == work_task)
+        return;
+
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (task->state == tsFree) {
+        KernelExitCritical(ipl);
+        return;
+    }
+
+    if (task->state == tsRun || task->state == tsBlocked)
+        UnscheduleTask(task);
+    task->state = tsFree;
+
+    KernelFreeStack(task->stack_base, task->stack_size);
+
+    while (num_tasks > 0 && tasks[num_tasks-1].state == tsFree)
+        num_tasks--;
+
+    KernelExitCritical(ipl);
+
+    // If a task deletes itself it must never run again. Nothing can reuse its
+    // stack until we've switched away from it, since no other task can run until then.
+    if (task == current_task) {
+        KernelSwitchContext();
+        while (1); // Never returns
+    }
+}
+
+void KernelTaskExit() {
+    // A task's proc returns here (see KernelInitTaskStack)
+    DeleteTask(current_task);
+}
+
+void SetTaskState(task_t* task, task_state_t state) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (task->state == tsFree) {
+        KernelExitCritical(ipl);
+        return;
+    }
+
+    if (task->state == tsRun || task->state == tsBlocked)
+        UnscheduleTask(task);
+
+    task->state = state;
+
+    if (state == tsRun)
+        ScheduleTask(task);
+
+    KernelExitCritical(ipl);
+}
+
+uint32 KernelTimestamp() {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    tick_t tick = systick;
+    uint tmr = TMR1;
+
+    // If the T1 interrupt is pending (eg. called from a higher priority ISR)
+    // the systick hasn't been incremented yet. Re-read TMR1 in case it rolled
+    // over between the two reads.
+    if (_T1IF) {
+        tmr = TMR1;
+#ifdef KERNEL_TICKLESS
+        tick += (tickless_ticks) ? tickless_ticks : 1;
+#else
+        tick++;
+#endif
+    }
+
+    KernelExitCritical(ipl);
+    return tick * SYSTICK_TMR_PERIOD + tmr;
+}
+
+uint32 KernelBootTimestamp() {
+    if (kernel_started)
+        return boot_time + KernelTimestamp();
+
+    // The boot timer has no interrupt, so count its rollovers here.
+    // Re-read TMR1 in case it rolled over between the two reads.
+    uint tmr = TMR1;
+    if (_T1IF) {
+        _T1IF = 0;
+        boot_epoch += 0x10000;
+        tmr = TMR1;
+    }
+    return boot_epoch + tmr;
+}
+
+uint32 KernelIdleTime() {
+    uint ipl;
+    KernelEnterCritical(ipl);
+    uint32 time = idle_task->run_time;
+
+    // Include the time since the last switch if we're called from idle
+    // (eg. an interrupt woke it)
+    if (current_task == idle_task)
+        time += KernelTimestamp() - last_switch_time;
+
+    KernelExitCritical(ipl);
+    return time;
+}
+
+#ifdef KERNEL_TRACE
+void KernelTrace(trace_event_t event, uint8 arg, uint16 param) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    uint i = trace_head + trace_count;
+    if (i >= TRACE_BUFFER_LEN)
+        i -= TRACE_BUFFER_LEN;
+
+    if (trace_count == TRACE_BUFFER_LEN) {
+        // Buffer is full, overwrite the oldest record
+        if (++trace_head == TRACE_BUFFER_LEN)
+            trace_head = 0;
+        trace_dropped++;
+    } else {
+        trace_count++;
+    }
+
+    trace_record_t* record = &trace_buffer[i];
+    record->time = KernelTimestamp();
+    record->event = event;
+    record->arg = arg;
+    record->param = param;
+
+    KernelExitCritical(ipl);
+}
+
+uint KernelReadTrace(trace_record_t* records, uint max) {
+    uint n;
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    for (n=0; n<max && trace_count > 0; n++) {
+        records[n] = trace_buffer[trace_head];
+        if (++trace_head == TRACE_BUFFER_LEN)
+            trace_head = 0;
+        trace_count--;
+    }
+
+    KernelExitCritical(ipl);
+    return n;
+}
+#endif
+
+uint16 KernelStackHighWater(task_t* task) {
+    // Stacks grow upwards, so find the highest word that isn't the canary
+    uint16* stack = KernelStackPtr(task->stack_base);
+    uint16 n = task->stack_size / 2;
+    while (n > 0 && stack[n-1] == STACK_CANARY)
+        n--;
+    return n * 2;
+}
+
+void KernelResetLatency(task_t* task) {
     uint i;
-    for (i=0; i<num_tasks; i++) {
-        task_t* task = &tasks[i];
-        if (task->next_run > last_tick)
-            task->next_run -= last_tick;
-        else if (task->next_run > 0)
-            task->next_run = 0;
-        // else rollover will have corrected it
+    for (i=0; i<LATENCY_BUCKETS; i++)
+        task->latency[i] = 0;
+    task->max_latency = 0;
+}
+
+static void KernelRecordLatency(task_t* task, uint32 latency) {
+    if ((int32)latency < 0)
+        latency = 0; // Dispatched within the same T1 count
+
+    if (latency > task->max_latency)
+        task->max_latency = latency;
+
+    // log2 bucket
+    uint bucket = 0;
+    while (latency && bucket < LATENCY_BUCKETS-1) {
+        latency >>= 1;
+        bucket++;
     }
+
+    if (task->latency[bucket] != MAX_UINT16)
+        task->latency[bucket]++;
+}
+
+tick_t GetTicks() {
+    // The T1 ISR may increment the systick between reading the low and high
+    // words, so keep reading until we get the same value twice.
+    // (The ISR updates both words with interrupts disabled, so this is also
+    // safe to call from a higher priority interrupt.)
+    tick_t tick;
+    do {
+        tick = systick;
+    } while (tick != systick);
+    return tick;
 }
 
 void KernelStart() {
+    // Carry the boot time on from here
+    boot_time = KernelBootTimestamp();
     systick_init();
+    boot_time -= KernelTimestamp();
+    kernel_started = true;
 
     // Initialize the kernel
-    current_task_index = 0;
     current_task = idle_task;
     KernelStartTask(idle_task);
 
@@ -151,30 +716,216 @@ void KernelStart() {
     Reset(); // Safety trap
 }
 
+#ifdef KERNEL_TICKLESS
+static uint KernelTicksUntilNextRun() {
+    // Returns the number of systicks until the earliest task needs to run
+    if (ready_bitmap)
+        return 0;
+    if (sleep_list == NULL)
+        return TICKLESS_MAX_TICKS;
+
+    // The sleep list is sorted, so the head is always due first
+    int32 ticks = TickDiff(sleep_list->next_run, systick);
+    if (ticks <= 0)
+        return 0;
+    if (ticks > TICKLESS_MAX_TICKS)
+        return TICKLESS_MAX_TICKS;
+    return ticks;
+}
+
+static void KernelEnterTickless(uint ticks) {
+    // Stretch the systick period so the next T1 interrupt occurs when the
+    // earliest task is due. TMR1 keeps counting from the last systick,
+    // so the tick phase is preserved.
+    _T1IE = 0;
+    tickless_ticks = ticks;
+    PR1 = ticks * SYSTICK_TMR_PERIOD - 1;
+    resched_pending = 1; // The scheduler has to catch systick up
+    _T1IE = 1;
+}
+
+static void KernelExitTickless() {
+    // If the systick expired, KernelSwitchTask() will already have accounted
+    // for the ticks spent sleeping. Otherwise we were woken early by another
+    // interrupt (eg. button press), so catch systick up to the current time.
+    uint ipl;
+    KernelEnterCritical(ipl);
+    if (tickless_ticks && !_T1IF) {
+        uint tmr = TMR1;
+        uint elapsed = tmr / SYSTICK_TMR_PERIOD;
+
+        // Keep the remainder so the tick phase is preserved
+        // (may lose a single T1 count if it increments during the write)
+        TMR1 = tmr - elapsed * SYSTICK_TMR_PERIOD;
+        PR1 = SYSTICK_TMR_PR;
+
+        systick += elapsed;
+        tickless_ticks = 0;
+    }
+    KernelExitCritical(ipl);
+}
+#endif
+
+void KernelSetIdleHook(idle_hook_t hook) {
+    idle_hook = hook;
+}
+
 void KernelIdleTask() {
     // This task runs whenever nothing else needs to run.
 
     while (1) {
+        // Background work first, the CPU only sleeps once it's done
+        if (idle_hook != NULL && idle_hook())
+            continue;
+
+        // Interrupts are masked until we're asleep, so an interrupt that
+        // readies a task can't slip in between checking and sleeping.
+        // (Masked interrupts still wake the CPU, and are serviced below.)
+        uint ipl;
+        KernelEnterCritical(ipl);
+
+#ifdef KERNEL_TICKLESS
+        // Only wake up when the next task is due (or on an external interrupt).
+        // If a systick is already pending it has to be counted as a single
+        // tick, so don't stretch the period under it.
+        uint ticks = KernelTicksUntilNextRun();
+        if (ticks > 1 && !_T1IF)
+            KernelEnterTickless(ticks);
+#endif
+
         // Go to sleep for a bit... (will wake up on systick)
-        if (usb_connected) {
-            // Use Idle mode if connected to USB, because Sleep mode will kill the connection.
-            Idle();
+        if (ready_bitmap) {
+            // A task was readied by an interrupt, don't sleep
         } else {
-            Sleep();
-            //Idle();
+            uint32 t = KernelTimestamp();
+
+            if (usb_connected) {
+                // Use Idle mode if connected to USB, because Sleep mode will kill the connection.
+                Idle();
+            } else {
+                Sleep();
+                //Idle();
+            }
+
+            sleep_time += KernelTimestamp() - t;
         }
 
+        KernelExitCritical(ipl);
+
         // Average current (screen off):
         //  Sleep: 2.85mA
         //  Idle: 11.45mA
         //  None: 19.09mA
         //TODO: Baseline is 800uA-1mA, try and get it down to that level
 
+#ifdef KERNEL_TICKLESS
+        KernelExitTickless();
+#endif
+
         // Check to see if any tasks need to run yet
         Delay(0);
     }
 }
 
+void KernelWorkTask() {
+    // Runs work deferred from interrupts (see KernelDefer),
+    // and the callbacks of any software timers that are due.
+    work_item_t item;
+
+    while (1) {
+        if (QueueReceive(&work_queue, &item, TimerWaitTicks())) {
+            if (item.proc != NULL)
+                item.proc(item.param);
+        }
+
+        TimerService();
+    }
+}
+
+bool KernelDefer(work_proc_t proc, uint param) {
+    work_item_t item;
+    item.proc = proc;
+    item.param = param;
+    return QueueSend(&work_queue, &item);
+}
+
+static uint KernelUsage(uint32 time, uint32* window_time, uint32 window) {
+    // Utilization (0.1% units) since the start of the window
+    uint32 delta = time - *window_time;
+    *window_time = time;
+    return delta * 1000 / window;
+}
+
+static void KernelAccountTime() {
+    // Charge the time since the last switch to the current task
+    // (minus any time spent in interrupts)
+    uint32 now = KernelTimestamp();
+    uint32 elapsed = now - last_switch_time;
+    if (isr_time_since_switch < elapsed)
+        current_task->run_time += elapsed - isr_time_since_switch;
+    isr_time_since_switch = 0;
+    last_switch_time = now;
+
+    // Update the utilization figures at the end of each window.
+    // (Deltas of the running totals, so nothing has to be reset)
+    uint32 window = now - window_start_time;
+    if (window < (uint32)CPU_USAGE_WINDOW * SYSTICK_TMR_PERIOD)
+        return;
+    window_start_time = now;
+
+    uint i;
+    uint total = 0;
+    for (i=0; i<num_tasks; i++) {
+        task_t* task = &tasks[i];
+        task->cpu_usage = KernelUsage(task->run_time, &task->window_run_time, window);
+        if (task != idle_task)
+            total += task->cpu_usage;
+    }
+    total_cpu_usage = total;
+
+    sleep_usage = KernelUsage(sleep_time, &window_sleep_time, window);
+    for (i=0; i<NUM_KERNEL_ISRS; i++)
+        isr_usage[i] = KernelUsage(isr_time[i], &window_isr_time[i], window);
+
+    // Add current CPU utilization to the history buffer
+    cpu_tick_history[cpu_tick_history_idx] = total_cpu_usage;
+    if (++cpu_tick_history_idx == CPU_TICK_HISTORY_LEN)
+        cpu_tick_history_idx = 0;
+}
+
+void KernelIsrEnter(kernel_isr_t id) {
+    KernelTrace(trIsrEnter, id, 0);
+    isr_start_time[id] = KernelTimestamp();
+}
+
+void KernelIsrExit(kernel_isr_t id) {
+    uint32 elapsed = KernelTimestamp() - isr_start_time[id];
+
+    uint ipl;
+    KernelEnterCritical(ipl);
+    isr_time[id] += elapsed;
+    isr_time_since_switch += elapsed;
+    KernelExitCritical(ipl);
+
+    KernelTrace(trIsrExit, id, 0);
+}
+
+static void KernelPlanNextSwitch(task_t* task) {
+    // Work out when the T1 ISR next needs to call the scheduler.
+    // Until then it only increments systick.
+    tick_t next = systick + CPU_USAGE_WINDOW; // Keep the CPU usage up to date
+
+    if (task != idle_task && task->next != NULL) {
+        // Another task of the same priority is waiting for its turn
+        next = systick + 1;
+    } else if (sleep_list != NULL && TickAfter(next, sleep_list->next_run)) {
+        next = sleep_list->next_run;
+    }
+
+    next_switch_tick = next;
+    resched_pending = 0;
+}
+
 void KernelSwitchTask() {
     // NOTE: Called directly from the kernel core (see kernel_asm.s)
     // The kernel will automatically push the current task's registers
@@ -182,76 +933,463 @@ void KernelSwitchTask() {
 
     ClrWdt();
 
-    static uint last_tick;
-    uint i;
-
-    // Rollover occurred (should occur roughly every 65 seconds)
-    if (last_tick > systick) {
-        fix_rollover(last_tick);
-    }
-    last_tick = systick;
-
-    if (cpu_tick_counter == CALC_CPU_TICKS) {
-        cpu_tick_counter = 0;
-        total_cpu_ticks = 0;
-        for (i=0; i<num_tasks; i++) {
-            task_t* task = &tasks[i];
-            //task->cpu_usage = task->cpu_ticks * 1000 / CALC_CPU_TICKS;
-            task->cpu_ticks = task->ticks;
-            if (i) total_cpu_ticks += task->ticks; // Skip the idle task
-            task->ticks = 0;
-        }
-
-        // Add current CPU utilization to the history buffer
-        cpu_tick_history[cpu_tick_history_idx] = total_cpu_ticks;
-        if (cpu_tick_history_idx++ == CPU_TICK_HISTORY_LEN)
-            cpu_tick_history_idx = 0;
+#ifdef KERNEL_TICKLESS
+    // The systick ISR only counts one tick, account for the rest of the
+    // stretched period and go back to ticking normally.
+    if (tickless_ticks) {
+        systick += tickless_ticks - 1;
+        tickless_ticks = 0;
+        PR1 = SYSTICK_TMR_PR;
     }
-    cpu_tick_counter++;
-
-    // Find the next task that needs to be run
-    uint start_index = current_task_index;
-    do {
-        current_task_index++;
+#endif
 
-        if (current_task_index == num_tasks)
-            current_task_index = 0;
+    KernelAccountTime();
 
-        task_t* task = &tasks[current_task_index];
+    WakeSleepingTasks();
 
-        if (task->state == tsRun) {
-            if (systick >= task->next_run) {
-                task->next_run = systick;// + 50;
+    // Round-robin: move the current task to the back of its run queue
+    // so other tasks of the same priority get a turn.
+    task_t* task = current_task;
+    if (task->state == tsRun && task->ready && ready_head[task->priority] == task) {
+        ReadyRemove(task);
+        ReadyPush(task);
+    }
 
-                _LAT(LED2) = 1;
-                KernelSwitchToTask(task);
-                return;
-            }
-        }
+    // Run the first task in the highest priority non-empty queue
+    if (ready_bitmap) {
+        task = ready_head[HighestBit(ready_bitmap)];
+        task->next_run = systick;
 
-    } while (current_task_index != start_index);
+        _LAT(LED2) = 1;
+    } else {
+        // If no tasks need to be run, go to the idle task (puts the MCU into sleep mode)
+        task = idle_task;
+        _LAT(LED2) = 0;
+    }
 
-    // If no tasks need to be run, go to the idle task (puts the MCU into sleep mode)
-    _LAT(LED2) = 0;
-    KernelSwitchToTask(idle_task);
+    KernelSwitchToTask(task);
+    KernelPlanNextSwitch(task);
 
     // Upon returning, the kernel will switch the stack to the pointer
     // in 'task_sp', then pop the task's registers back, and continue
     // where the task was left off.
 }
 
+static void KernelSleepUntil(tick_t tick) {
+    task_t* task = current_task;
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    task->next_run = tick;
+
+    // Stay in the run queue if the task is already due.
+    // (It never slept, so this isn't a wakeup and its latency isn't recorded.)
+    if (task->state == tsRun && task->ready && TickAfter(tick, systick)) {
+        ReadyRemove(task);
+        SleepPush(task);
+    }
+
+    KernelExitCritical(ipl);
+}
+
+static bool KernelOthersReady() {
+    // True if another task could run instead of the current one
+    task_t* task = current_task;
+    uint ipl;
+    KernelEnterCritical(ipl);
+    bool others = !(task->ready && ready_head[task->priority] == task && task->next == NULL &&
+            HighestBit(ready_bitmap) == task->priority);
+    KernelExitCritical(ipl);
+    return others;
+}
+
 void Delay(uint millis) {
     // Delay for the specified amount of time, allowing other tasks to execute.
-    // If t=0, it just forces a context switch
-    current_task->next_run = systick + millis;
+    // If t=0, it just forces a context switch (unless there's nothing else to run)
+    KernelTrace(trDelay, current_task - tasks, millis);
+    if (millis == 0 && !KernelOthersReady())
+        return;
+
+    KernelSleepUntil(GetTicks() + millis);
     KernelSwitchContext();
 }
 
-void WaitUntil(uint tick) {
+void DelayOrSpin(uint millis) {
+    if (kernel_started) {
+        Delay(millis);
+        return;
+    }
+
+    // Busy-wait on the boot timer, rounding up to the next T1 count
+    uint32 end = KernelBootTimestamp() + (uint32)millis * 32768 / 1000 + 1;
+    while (TickDiff(KernelBootTimestamp(), end) < 0)
+        ClrWdt();
+}
+
+void WaitUntil(tick_t tick) {
     // Wait until systick reaches the specified value.
     // Useful for functions that take a long or variable amount of time to execute,
     // but are required to execute periodically (eg. 10Hz)
     // If tick < current systick, the task will execute in the next available slot.
-    current_task->next_run = tick;
+    KernelTrace(trWaitUntil, current_task - tasks, (uint16)tick);
+    KernelSleepUntil(tick);
     KernelSwitchContext();
-}
\ No newline at end of file
+}
+////////// Blocking ////////////////////////////////////////////////////////////
+
+static void KernelPreempt(uint ipl) {
+    // Switch straight away if a higher priority task was woken,
+    // unless we were called from an interrupt (it will switch on the next systick)
+    if (ipl == 0 && current_task != NULL && ready_bitmap &&
+            HighestBit(ready_bitmap) > current_task->priority)
+        KernelSwitchContext();
+}
+
+static bool KernelWait(task_t** wait_list, uint timeout, tick_t deadline, uint* ipl) {
+    // Block the current task on the wait list until it is woken or the
+    // deadline passes. Returns false if it timed out.
+    // NOTE: Must be called from within a critical section,
+    //  which is released while the task is blocked.
+    task_t* task = current_task;
+
+    if (task->state != tsRun)
+        return false;
+    if (timeout != WAIT_FOREVER && TickDiff(systick, deadline) >= 0)
+        return false;
+
+    KernelTrace(trBlock, task - tasks, timeout);
+
+    UnscheduleTask(task);
+    task->state = tsBlocked;
+    task->wait_timed_out = false;
+    task->wait_list = wait_list;
+    task->wait_next = *wait_list;
+    *wait_list = task;
+
+    if (timeout != WAIT_FOREVER) {
+        task->next_run = deadline;
+        SleepPush(task);
+    }
+
+    // NOTE: KernelSwitchContext() returns with interrupts enabled
+    KernelExitCritical(*ipl);
+    KernelSwitchContext();
+    KernelEnterCritical(*ipl);
+
+    return !task->wait_timed_out;
+}
+
+static void KernelWakeOne(task_t* waiters) {
+    // Wake the highest priority task in the wait list
+    // (the one that has waited longest, if there are several)
+    task_t* task;
+    task_t* best = NULL;
+    for (task=waiters; task != NULL; task=task->wait_next) {
+        if (best == NULL || task->priority >= best->priority)
+            best = task;
+    }
+    if (best != NULL)
+        UnblockTask(best);
+}
+
+////////// Event Flags /////////////////////////////////////////////////////////
+
+void EventFlagsInit(event_flags_t* ev) {
+    ev->flags = 0;
+    ev->waiters = NULL;
+}
+
+void EventFlagsSet(event_flags_t* ev, uint flags) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    ev->flags |= flags;
+
+    // Wake every task waiting on any of the flags
+    task_t* task = ev->waiters;
+    while (task != NULL) {
+        task_t* next = task->wait_next;
+        if (task->wait_mask & ev->flags)
+            UnblockTask(task);
+        task = next;
+    }
+
+    KernelExitCritical(ipl);
+    KernelPreempt(ipl);
+}
+
+void EventFlagsClear(event_flags_t* ev, uint flags) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+    ev->flags &= ~flags;
+    KernelExitCritical(ipl);
+}
+
+uint EventFlagsWait(event_flags_t* ev, uint mask, uint timeout) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    tick_t deadline = systick + timeout;
+    current_task->wait_mask = mask;
+
+    while (!(ev->flags & mask)) {
+        if (!KernelWait(&ev->waiters, timeout, deadline, &ipl))
+            break;
+    }
+
+    uint flags = ev->flags & mask;
+    ev->flags &= ~flags;
+
+    KernelExitCritical(ipl);
+    return flags;
+}
+
+////////// Semaphores //////////////////////////////////////////////////////////
+
+void SemaphoreInit(semaphore_t* sem, uint count) {
+    sem->count = count;
+    sem->waiters = NULL;
+}
+
+void SemaphoreGive(semaphore_t* sem) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+    sem->count++;
+    KernelWakeOne(sem->waiters);
+    KernelExitCritical(ipl);
+    KernelPreempt(ipl);
+}
+
+bool SemaphoreTake(semaphore_t* sem, uint timeout) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    tick_t deadline = systick + timeout;
+
+    while (sem->count == 0) {
+        if (!KernelWait(&sem->waiters, timeout, deadline, &ipl))
+            break;
+    }
+
+    bool taken = (sem->count > 0);
+    if (taken)
+        sem->count--;
+
+    KernelExitCritical(ipl);
+    return taken;
+}
+
+////////// Message Queues //////////////////////////////////////////////////////
+
+void QueueInit(queue_t* queue, void* buffer, uint item_size, uint length) {
+    queue->buffer = (byte*)buffer;
+    queue->item_size = item_size;
+    queue->length = length;
+    queue->head = 0;
+    queue->count = 0;
+    queue->waiters = NULL;
+}
+
+bool QueueSend(queue_t* queue, const void* item) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (queue->count == queue->length) {
+        KernelExitCritical(ipl);
+        return false;
+    }
+
+    uint tail = queue->head + queue->count;
+    if (tail >= queue->length)
+        tail -= queue->length;
+    memcpy(&queue->buffer[tail * queue->item_size], item, queue->item_size);
+    queue->count++;
+
+    KernelWakeOne(queue->waiters);
+
+    KernelExitCritical(ipl);
+    KernelPreempt(ipl);
+    return true;
+}
+
+bool QueueReceive(queue_t* queue, void* item, uint timeout) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    tick_t deadline = systick + timeout;
+
+    while (queue->count == 0) {
+        if (!KernelWait(&queue->waiters, timeout, deadline, &ipl))
+            break;
+    }
+
+    bool received = (queue->count > 0);
+    if (received) {
+        memcpy(item, &queue->buffer[queue->head * queue->item_size], queue->item_size);
+        if (++queue->head == queue->length)
+            queue->head = 0;
+        queue->count--;
+    }
+
+    KernelExitCritical(ipl);
+    return received;
+}
+
+////////// Software Timers /////////////////////////////////////////////////////
+
+static void TimerInsert(soft_timer_t* timer) {
+    // Keep the list sorted by deadline (after any timers with the same deadline)
+    soft_timer_t** p = &timer_list;
+    while (*p != NULL && !TickAfter((*p)->deadline, timer->deadline))
+        p = &(*p)->next;
+    timer->next = *p;
+    *p = timer;
+}
+
+static void TimerRemove(soft_timer_t* timer) {
+    soft_timer_t** p = &timer_list;
+    while (*p != NULL) {
+        if (*p == timer) {
+            *p = timer->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    timer->next = NULL;
+}
+
+static uint TimerWaitTicks() {
+    // Number of systicks the worker can block for before the next timer is due
+    uint timeout = WAIT_FOREVER;
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (timer_list != NULL) {
+        int32 diff = TickDiff(timer_list->deadline, systick);
+        if (diff <= 0)
+            timeout = 0;
+        else if (diff < WAIT_FOREVER)
+            timeout = diff;
+        else
+            timeout = WAIT_FOREVER - 1;
+    }
+
+    KernelExitCritical(ipl);
+    return timeout;
+}
+
+static void TimerService() {
+    // Run the callbacks of all the timers that are due
+    while (1) {
+        uint ipl;
+        KernelEnterCritical(ipl);
+
+        soft_timer_t* timer = timer_list;
+        if (timer == NULL || TickAfter(timer->deadline, systick)) {
+            KernelExitCritical(ipl);
+            break;
+        }
+
+        timer_list = timer->next;
+        if (timer->period) {
+            // Stay in phase, unless we've fallen more than a period behind
+            timer->deadline += timer->period;
+            if (!TickAfter(timer->deadline, systick))
+                timer->deadline = systick + timer->period;
+            TimerInsert(timer);
+        } else {
+            timer->active = false;
+            timer->next = NULL;
+        }
+
+        work_proc_t proc = timer->proc;
+        uint param = timer->param;
+        KernelExitCritical(ipl);
+
+        proc(param);
+    }
+}
+
+void TimerInit(soft_timer_t* timer, work_proc_t proc, uint param) {
+    timer->proc = proc;
+    timer->param = param;
+    timer->deadline = 0;
+    timer->period = 0;
+    timer->active = false;
+    timer->next = NULL;
+}
+
+void TimerStart(soft_timer_t* timer, uint delay, uint period) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (timer->active)
+        TimerRemove(timer);
+
+    timer->deadline = systick + delay;
+    timer->period = period;
+    timer->active = true;
+    TimerInsert(timer);
+
+    // Wake the worker in case it is waiting on a later deadline
+    bool wake = (timer_list == timer);
+
+    KernelExitCritical(ipl);
+
+    if (wake)
+        KernelDefer(NULL, 0);
+}
+
+void TimerStop(soft_timer_t* timer) {
+    uint ipl;
+    KernelEnterCritical(ipl);
+
+    if (timer->active) {
+        TimerRemove(timer);
+        timer->active = false;
+    }
+
+    KernelExitCritical(ipl);
+}
+
+////////// Coroutines //////////////////////////////////////////////////////////
+
+static void CoroutineRun(uint index) {
+    // Timer callback, resume the coroutine where it left off
+    coroutine_t* co = &coroutines[index];
+    co->proc(co);
+}
+
+coroutine_t* RegisterCoroutine(coroutine_proc_t proc) {
+    if (num_coroutines >= MAX_COROUTINES)
+        CriticalError("Too many coroutines");
+
+    coroutine_t* co = &coroutines[num_coroutines];
+    co->proc = proc;
+    TimerInit(&co->timer, CoroutineRun, num_coroutines);
+    num_coroutines++;
+
+    CoroutineStart(co);
+    return co;
+}
+
+void CoroutineStart(coroutine_t* co) {
+    co->line = 0;
+    TimerStart(&co->timer, 0, 0);
+}
+
+void CoroutineStop(coroutine_t* co) {
+    TimerStop(&co->timer);
+    co->line = 0;
+}
+
+void CoroutineWait(coroutine_t* co, uint line, tick_t tick) {
+    co->line = line;
+
+    int32 diff = TickDiff(tick, GetTicks());
+    if (diff < 0)
+        diff = 0;
+    else if (diff > MAX_UINT)
+        diff = MAX_UINT;
+    TimerStart(&co->timer, diff, 0);
+}
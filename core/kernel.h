@@ -15,31 +15,78 @@
 #define SYSTICK_PERIOD 1        //ms  (Note: It is recommended you keep it at 1ms or timings will be wrong)
 #define SYSTICK_PRESCALER 8     // 1, 8, 64, 256
 
+#define SYSTICK_TMR_PR 32       // T1 period register value for one systick (32.768kHz SOSC)
+
+// Stop the systick while the idle task sleeps, and only wake up when the next task is due.
+// Comment out to wake on every systick.
+#define KERNEL_TICKLESS
+#define TICKLESS_MAX_TICKS 1000 // Maximum number of systicks to sleep for in one go
+
 #define TASK_NAME_LEN 6         // Maximum chars allocated for a task's name
 
-// IMPORTANT: If you increase the stack size, make sure you also increase the allocated space in kernel_asm.s
-#define TASK_STACK_SIZE 512     // Size of the stack for each task
-#define MAX_TASKS 8            // Maximum number of tasks allocated
+// IMPORTANT: The reserve plus all task stacks must fit in the space allocated in kernel_asm.s
+#define TASK_STACK_SIZE 512     // Default size of the stack for each task
+#define KERNEL_STACK_RESERVE 512 // Stack used by main() before the kernel starts
+#define STACK_CANARY 0xA5A5     // Unused stack is filled with this, so we can measure the high-water mark
+#define STACK_GUARD 16          // Bytes left above each task's SPLIM, so a stack error trap can't corrupt the next task
+#ifndef MAX_TASKS
+#define MAX_TASKS 8            // Maximum number of tasks allocated (the posix port raises this)
+#endif
+
+#define NUM_PRIORITIES 8        // Number of task priority levels (max 16, one bit each in the ready bitmap)
+
+#define WORK_QUEUE_LEN 16       // Maximum number of deferred work items waiting to run
+#define MAX_COROUTINES 8        // Maximum number of stackless coroutines
 
-#define CALC_CPU_TICKS 1000      // Number of CPU ticks before CPU utilization is re-calculated.
+// Record context switches, ISRs and delays into a ring buffer (read over USB with CMD_GET_TRACE).
+// Comment out to remove tracing.
+//#define KERNEL_TRACE
+#define TRACE_BUFFER_LEN 128    // Number of trace records (8 bytes each)
+
+#define CPU_USAGE_WINDOW 1000   // Number of systicks CPU utilization is averaged over
 
 #define CPU_TICK_HISTORY_LEN 128
 
+// Wakeup latency histogram buckets per task.
+// Bucket 0 counts latencies under 1 T1 count, bucket n counts 2^(n-1) to 2^n-1,
+// and the last bucket counts anything longer (2^10 counts = 31ms).
+#define LATENCY_BUCKETS 12
+
 ////////// Typedefs ////////////////////////////////////////////////////////////
 
-// IMPORTANT: The task_proc must NEVER return!
-//   Returning will cause bad things to happen, such as popping things off
-//   the end of the stack and returning to unknown addresses.
+// Returning from the task_proc deletes the task (see DeleteTask)
 typedef void (*task_proc_t)(void);
 
+typedef void (*work_proc_t)(uint param);
+
+// Background work run by the idle task (see KernelSetIdleHook)
+typedef bool (*idle_hook_t)(void);
+
+// Kernel time base, in systicks. Wraps after ~49 days, so always compare
+// ticks with the wrap-safe helpers below rather than < or >.
+typedef uint32 tick_t;
+
 typedef enum { 
     tsStop,     // Task is not running
     tsIdle,     // Task is using a peripheral (do not put CPU into sleep mode)
-    tsRun       // Task is actively running
+    tsRun,      // Task is actively running
+    tsBlocked,  // Task is waiting on an event flag, semaphore or queue
+    tsFree      // Task has been deleted, the slot can be reused
 } task_state_t;
 
-typedef struct {
+// Higher priority tasks always pre-empt lower priority tasks,
+// tasks of the same priority are scheduled round-robin.
+typedef enum {
+    prIdle = 0,         // Reserved for the idle task
+    prLow = 1,          // Background processing (eg. sensor sampling)
+    prNormal = 3,       // Communications
+    prHigh = 5,         // User interaction (eg. buttons, display)
+    prRealtime = 7      // Must run as soon as possible
+} task_priority_t;
+
+typedef struct task_t {
     uint16 sp;          // Stored task stack pointer for context switch (MUST BE FIRST MEMBER IN STRUCT)
+    uint16 splim;       // Stack limit, loaded into SPLIM on context switch (MUST BE SECOND MEMBER IN STRUCT)
 
     uint16 stack_base;  // Task stack base address
     uint16 stack_size;  // Task stack size
@@ -48,15 +95,99 @@ typedef struct {
 
     task_proc_t proc;
     task_state_t state;
+    task_priority_t priority;
+
+    // Scheduler queues (a running task is either ready or sleeping)
+    struct task_t* next;
+    bool ready;
+
+    // Blocking (a blocked task is on a wait list, and sleeping if it has a timeout)
+    struct task_t** wait_list;
+    struct task_t* wait_next;
+    uint wait_mask;     // Event flags the task is waiting for
+    bool wait_timed_out;
 
-    uint next_run;
+    tick_t next_run;
 
-    uint ticks;
+    uint ticks;         // Number of times the task has been scheduled
     uint last_run;
-    uint cpu_usage;
-    uint cpu_ticks;
+
+    // CPU accounting
+    uint32 run_time;    // Total time spent running, in T1 counts (see KernelTimestamp())
+    uint32 window_run_time; // run_time at the start of the current usage window
+    uint cpu_usage;     // Utilization over the last window (0.1% units)
+
+    // Wakeup latency (time from becoming due to actually running)
+    uint32 wake_time;   // When the task became due, in T1 counts
+    bool wake_pending;  // Woken but not dispatched yet
+    uint32 max_latency; // T1 counts
+    uint16 latency[LATENCY_BUCKETS]; // log2 histogram (see LATENCY_BUCKETS)
 } task_t;
 
+typedef enum {
+    trSwitch,       // arg = task index switched to
+    trIsrEnter,     // arg = kernel_isr_t
+    trIsrExit,      // arg = kernel_isr_t
+    trDelay,        // arg = task index, param = delay (systicks)
+    trWaitUntil,    // arg = task index, param = target systick (low 16 bits)
+    trBlock         // arg = task index, param = timeout (systicks)
+} trace_event_t;
+
+// Interrupts that are traced and accounted for (see KernelIsrEnter)
+typedef enum { kiCN, kiADC, NUM_KERNEL_ISRS } kernel_isr_t;
+
+typedef struct __attribute__((packed)) {
+    uint32 time;        // T1 counts (1/32768 s), see KernelTimestamp()
+    uint8 event;        // trace_event_t
+    uint8 arg;
+    uint16 param;
+} trace_record_t;
+
+// A set of bits that tasks can wait on. Waiting consumes the flags that were set.
+typedef struct {
+    volatile uint flags;
+    task_t* waiters;
+} event_flags_t;
+
+// Counting semaphore
+typedef struct {
+    volatile uint count;
+    task_t* waiters;
+} semaphore_t;
+
+// Fixed-size message queue. Items are copied in and out of the buffer.
+typedef struct {
+    byte* buffer;
+    uint item_size;
+    uint length;        // Maximum number of items in the buffer
+    volatile uint head;
+    volatile uint count;
+    task_t* waiters;
+} queue_t;
+
+// Software timer. The callback runs on the kernel's worker task (see KernelDefer),
+// so it must run to completion quickly and never block.
+typedef struct soft_timer_t {
+    work_proc_t proc;
+    uint param;
+    tick_t deadline;
+    uint period;        // systicks, 0 for a one-shot timer
+    bool active;
+    struct soft_timer_t* next;
+} soft_timer_t;
+
+// Stackless (protothread-style) coroutine. Runs on the kernel's worker task,
+// resuming from the last CoDelay/CoWaitUntil each time it is called.
+// Local variables are NOT preserved across waits, keep state in statics.
+struct coroutine_t;
+typedef void (*coroutine_proc_t)(struct coroutine_t* co);
+
+typedef struct coroutine_t {
+    coroutine_proc_t proc;
+    uint line;          // Where to resume from (0 = start)
+    soft_timer_t timer;
+} coroutine_t;
+
 
 ////////// Constants ///////////////////////////////////////////////////////////
 
@@ -66,23 +197,164 @@ typedef struct {
 #define SYSTICK_PS_VAL(val) T1_PS_1_##val   // lookup the relevant T1_PS_1_x define
 #define SYSTICK_PS(val) SYSTICK_PS_VAL(val) // required for the macro to work
 
+// Number of T1 counts per systick (T1 resets on the count after matching PR1)
+#define SYSTICK_TMR_PERIOD (SYSTICK_TMR_PR+1)
+
+// T1 runs from the 32.768kHz SOSC, so a systick is slightly longer than 1ms
+#define SecondsToTicks(s) ((tick_t)(s) * 32768UL / SYSTICK_TMR_PERIOD)
+
 
 ////////// Methods /////////////////////////////////////////////////////////////
 
 extern void InitializeKernel();
 extern void KernelStart();
 
-extern task_t* RegisterTask(char* name, task_proc_t proc);
+// stack_size is in bytes, or 0 for the default (TASK_STACK_SIZE).
+// Reuses the slots and stacks of deleted tasks. Once the kernel has started,
+// returns NULL if there are no free slots or stack space.
+extern task_t* RegisterTask(char* name, task_proc_t proc, task_priority_t priority, uint16 stack_size);
+
+// Stop the task and release its slot and stack. The task_t must not be used afterwards.
+// A task can delete itself (this never returns), which is the same as returning from its proc.
+extern void DeleteTask(task_t* task);
+
+// Start or stop a task. Safe to call from an interrupt.
+extern void SetTaskState(task_t* task, task_state_t state);
+
+// Returns the most stack the task has ever used, in bytes
+extern uint16 KernelStackHighWater(task_t* task);
+
+// Clear the task's wakeup latency histogram
+extern void KernelResetLatency(task_t* task);
+
+// Run 'hook' from the idle task whenever no other task is ready, before the CPU sleeps.
+// It runs at the lowest priority and may be pre-empted anywhere, so it must never block.
+// Return true if there's more work to do, otherwise the CPU goes back to sleep.
+// Pass NULL to remove the hook.
+extern void KernelSetIdleHook(idle_hook_t hook);
 
 extern void Delay(uint millis);
-extern void WaitUntil(uint tick);
+extern void WaitUntil(tick_t tick);
+
+// Delay, or busy-wait before KernelStart (for drivers that are also used during boot).
+// Must not be called with interrupts masked.
+extern void DelayOrSpin(uint millis);
+
+// Read the systick atomically (it is 32-bit, so can't be read in one go)
+extern tick_t GetTicks();
 
-#define WaitFor(condition) while (!(condition)) { Delay(0); }
+// Time since boot in T1 counts (32.768kHz), with sub-systick resolution
+extern uint32 KernelTimestamp();
+
+// Time since InitializeKernel in T1 counts, carrying on across KernelStart.
+// Before KernelStart it must be called at least every 2s (T1 rolls over uncounted).
+extern uint32 KernelBootTimestamp();
+
+// Total time spent in the idle task (including sleep), in T1 counts
+extern uint32 KernelIdleTime();
+
+#ifdef KERNEL_TRACE
+extern void KernelTrace(trace_event_t event, uint8 arg, uint16 param);
+// Copies (and removes) up to max records from the trace buffer, returns the number copied
+extern uint KernelReadTrace(trace_record_t* records, uint max);
+extern uint trace_dropped;
+#else
+#define KernelTrace(event, arg, param)
+#endif
+
+// Call at the start and end of an interrupt, to measure the time spent in it.
+// The time is not counted against the task that was interrupted.
+extern void KernelIsrEnter(kernel_isr_t id);
+extern void KernelIsrExit(kernel_isr_t id);
+
+// Wrap-safe tick comparisons.
+// Only valid while the ticks are less than 2^31 systicks (~24 days) apart.
+#define TickDiff(a, b) ((int32)((tick_t)(a) - (tick_t)(b)))
+#define TickAfter(a, b) (TickDiff(a, b) > 0)
+#define TickReached(deadline) (TickDiff(GetTicks(), deadline) >= 0)
+
+// Sleeps for a tick between checks so lower priority tasks get a chance to run
+#define WaitFor(condition) while (!(condition)) { Delay(1); }
+
+// Run proc(param) from the kernel's worker task (prRealtime) instead of an interrupt.
+// Interrupts should only capture state and defer the rest of their work with this.
+// Returns false if the work queue is full.
+extern bool KernelDefer(work_proc_t proc, uint param);
+
+// Blocking primitives.
+// Timeouts are in systicks; 0 never blocks, WAIT_FOREVER never times out.
+// The Set/Give/Send functions never block, so they are safe to call from interrupts.
+#define WAIT_FOREVER MAX_UINT
+
+extern void EventFlagsInit(event_flags_t* ev);
+extern void EventFlagsSet(event_flags_t* ev, uint flags);
+extern void EventFlagsClear(event_flags_t* ev, uint flags);
+// Returns (and clears) the flags in mask that were set, or 0 if it timed out
+extern uint EventFlagsWait(event_flags_t* ev, uint mask, uint timeout);
+
+extern void SemaphoreInit(semaphore_t* sem, uint count);
+extern void SemaphoreGive(semaphore_t* sem);
+// Returns false if it timed out
+extern bool SemaphoreTake(semaphore_t* sem, uint timeout);
+
+// buffer must be item_size * length bytes
+extern void QueueInit(queue_t* queue, void* buffer, uint item_size, uint length);
+// Returns false if the queue is full
+extern bool QueueSend(queue_t* queue, const void* item);
+// Returns false if it timed out
+extern bool QueueReceive(queue_t* queue, void* item, uint timeout);
+
+extern void TimerInit(soft_timer_t* timer, work_proc_t proc, uint param);
+// Calls proc(param) after delay systicks, then every period systicks (0 = only once).
+// Restarts the timer if it is already running.
+extern void TimerStart(soft_timer_t* timer, uint delay, uint period);
+extern void TimerStop(soft_timer_t* timer);
+#define TimerActive(timer) ((timer)->active)
+
+// Coroutines are started straight away, and stop when they reach CoEnd
+extern coroutine_t* RegisterCoroutine(coroutine_proc_t proc);
+// (Re)start the coroutine from the beginning
+extern void CoroutineStart(coroutine_t* co);
+extern void CoroutineStop(coroutine_t* co);
+#define CoroutineActive(co) TimerActive(&(co)->timer)
+
+// Used internally by the coroutine macros
+extern void CoroutineWait(coroutine_t* co, uint line, tick_t tick);
+
+// Coroutine body, eg:
+//  void Blink(coroutine_t* co) {
+//      CoBegin(co);
+//      while (1) {
+//          _LAT(LED1) ^= 1;
+//          CoDelay(co, 500);
+//      }
+//      CoEnd(co);
+//  }
+// NOTE: Only one Co* wait per line, and no switch statements around them.
+#define CoBegin(co) switch ((co)->line) { case 0:
+#define CoEnd(co) } (co)->line = 0; return
+
+// Same semantics as Delay/WaitUntil. CoDelay(co, 0) resumes on the next systick,
+// so a polling coroutine can't hog the worker task.
+#define CoWaitUntil(co, tick) \
+    do { CoroutineWait(co, __LINE__, tick); return; case __LINE__:; } while (0)
+#define CoDelay(co, millis) CoWaitUntil(co, GetTicks() + ((millis) ? (millis) : 1))
+#define CoWaitFor(co, condition) while (!(condition)) { CoDelay(co, 1); }
+
+// Block all interrupts (including the systick) while modifying kernel structures
+#define KernelEnterCritical(save_ipl) SET_AND_SAVE_CPU_IPL(save_ipl, 7)
+#define KernelExitCritical(save_ipl) RESTORE_CPU_IPL(save_ipl)
 
 // Load the current stack pointer into the stack_base variable,
 // which will then be used as the base stack pointer for application tasks.
 #define KernelSetSP() asm("mov W15, _stack_base\nmov W15, _current_stack_base")
 
+// Pointer to a task stack address. Ports that simulate the 16-bit data space
+// (see posix/port.h) define this to map addresses into their own RAM.
+#ifndef KernelStackPtr
+#define KernelStackPtr(addr) ((uint16*)(addr))
+#endif
+
 #if SYSTICK_PERIOD == 1
     #define IncSystick() systick++
 #else
@@ -92,10 +364,17 @@ extern void WaitUntil(uint tick);
 
 ////////// Properties //////////////////////////////////////////////////////////
 
-extern volatile uint systick;
+extern volatile tick_t systick;
+
+extern task_t tasks[MAX_TASKS];
+extern uint num_tasks;
 
-extern uint total_cpu_ticks;
+// Utilization over the last CPU_USAGE_WINDOW, in 0.1% units
+extern uint total_cpu_usage;    // All tasks except idle
+extern uint sleep_usage;        // Time spent in Sleep/Idle mode
+extern uint isr_usage[NUM_KERNEL_ISRS];
 
+// total_cpu_usage for each of the last CPU_TICK_HISTORY_LEN windows
 extern uint cpu_tick_history_idx;
 extern uint cpu_tick_history[CPU_TICK_HISTORY_LEN];
 
@@ -16,9 +16,16 @@
 .global _KernelSwitchContext
 .global _KernelInitTaskStack
 .global _KernelStartTask
+.global __StackError
 
 .extern _systick
+.extern _next_switch_tick
+.extern _resched_pending
+.extern _stack_base
+.extern _stack_limit
 .extern _KernelSwitchTask
+.extern _KernelStackError
+.extern _KernelTaskExit
 
 
 ;--- Code ---
@@ -31,9 +38,33 @@
 __T1Interrupt:
     bclr IFS0, #3
 
-    ; Increment kernel systick
+    ; Increment kernel systick (32-bit, so carry into the high word).
+    ; Interrupts are disabled so a higher priority ISR never sees half an update.
     ;clrwdt
+    disi #3
     inc _systick
+    bra nc, 1f
+    inc _systick+2
+1:
+    clrwdt
+
+    ; Fast path: if no task has been readied and nothing is due yet,
+    ; skip the scheduler (and saving all the registers) and return straight
+    ; to the current task. The scheduler sets these up (KernelPlanNextSwitch).
+    push.d w0
+    push.d w2
+    cp0 _resched_pending
+    bra nz, 2f
+    mov _systick, w0
+    mov _systick+2, w1
+    mov _next_switch_tick, w2
+    mov _next_switch_tick+2, w3
+    sub w0, w2, w0
+    subb w1, w3, w1
+    bra n, _T1Return    ; systick - next_switch_tick < 0
+2:
+    pop.d w2
+    pop.d w0
 
     ;btg LATE, #6  ; LED2
 
@@ -64,8 +95,11 @@ _KernelSwitchContext:
 
     call _KernelSwitchTask
 
-    ; Restore the stack pointer for the (new) current task
+    ; Restore the stack pointer and stack limit for the (new) current task
     mov _current_task, w0
+    mov [w0+2], w1 ; task->splim
+    mov w1, SPLIM
+    nop ; SPLIM can't be written immediately before a stack access
     mov [w0], SP
 
 _RestoreTaskContext:
@@ -93,16 +127,37 @@ _RestoreTaskContext:
     ; since it will return to the PC stored in the current stack.
 retfie
 
+_T1Return:
+    ; Nothing to schedule, carry on with the current task
+    pop.d w2
+    pop.d w0
+retfie
+
 
 _KernelInitTaskStack: ;(task_t* task: W0, task_proc_t proc: W1)
     ; This function initializes the stack for the given task so on the first
     ; context switch, it will start executing the task's proc.
 
+    ; NOTE: Must be called with interrupts disabled.
+
     push.s ; Store w0-w3
+    push SPLIM
+
+    ; The new stack may be above the current task's stack limit
+    mov _stack_limit, w2
+    mov w2, SPLIM
+    nop
+
     mov SP, w3 ; Save the original stack pointer
 
     mov [w0], SP ; task->sp
 
+    ; If the proc returns, it returns into KernelTaskExit (deletes the task)
+    mov #handle(_KernelTaskExit), w2
+    push w2     ; PC<15:0>
+    mov #0, w2
+    push w2     ; PC<22:16>
+
     ; Push the proc address into the return address
     push w1     ; PC<15:0>
     mov #0, w1
@@ -130,6 +185,8 @@ _KernelInitTaskStack: ;(task_t* task: W0, task_proc_t proc: W1)
     mov SP, [w0] ; task->sp
 
     mov w3, SP ; restore the original stack pointer
+    pop SPLIM
+    nop
     pop.s
 return
 
@@ -139,10 +196,27 @@ _KernelStartTask: ;(task_t* task: W0)
 
     ; To start a task, we set the current stack pointer to the task's stack pointer,
     ; then call the code exiting the ISR.
+    mov [w0+2], w1 ; task->splim
+    mov w1, SPLIM
+    nop
     mov [w0], SP
     goto _RestoreTaskContext
 
 
+__StackError:
+    ; A task has overflowed its stack (SP went past SPLIM).
+    ; The stack can't be trusted any more, so move to main()'s stack space
+    ; (unused once the kernel has started) and report which task it was.
+    bclr INTCON1, #2 ; STKERR
+    mov _stack_limit, w0
+    mov w0, SPLIM
+    nop
+    mov _stack_base, w0
+    mov w0, SP
+    call _KernelStackError
+    reset
+
+
 ;--- Stack Definition ---
 
 .section app_stack, stack
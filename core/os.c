@@ -15,6 +15,10 @@
 #include "os.h"
 #include "api/app.h"
 #include "hardware.h"
+#include "core/cpu.h"
+#include "core/boot.h"
+#include "core/input.h"
+#include "api/clock.h"
 
 #include "drivers/ssd1351.h"
 #include "background/comms.h"
@@ -33,11 +37,20 @@
 
 ////////// Variables ///////////////////////////////////////////////////////////
 
-#define DEBOUNCE_INTERVAL 25 //systicks (ms)
+#define LOW_BATTERY_FPS 4       // Frame rate cap for rdContinuous apps on a low battery
+
+// Draw task events
+#define DRAW_EVT_REDRAW 0x01        // Draw a new frame now (eg. after input)
+#define DRAW_EVT_PRERENDERED 0x02   // The off-screen buffer has the next frame
+#define DRAW_EVT_STOP 0x04          // Stop drawing (the screen is going off)
+
+// Core task events
+#define CORE_EVT_INPUT 0x01         // Something for InputRead
+#define CORE_EVT_WIPE_DONE 0x02     // Navigation held back by a wipe can go ahead
 
 enum { btnReleased=false, btnPressed=true };
 
-bool displayOn = true;
+bool displayOn = false;   // Set once ScreenOn has finished
 
 task_t* core_task;
 task_t* draw_task;
@@ -50,27 +63,43 @@ volatile bool lock_display = false;
 volatile bool display_frame_ready = false;
 volatile int wipe_frame = 0;
 
-// Note: button indicies start at 1
-static uint btn_debounce_tick[5];
-bool btn_state[5];
-bool btn_debouncing[5];
+static event_flags_t draw_events;
+static event_flags_t core_events;
+
+// App switches asked for but not done yet (-ve is back), so presses during
+// a wipe are added up and done as one
+static volatile int pending_nav = 0;
+
+// Frame pre-rendered by the idle task (see PrerenderFrame)
+static volatile uint frame_generation = 0; // Bumped by every regular frame, invalidates a pre-render in progress
+static volatile bool prerender_ready = false;
+static application_t* prerender_app;
+static tick_t prerender_tick;       // When the pre-rendered frame should be shown
 
-uint sleep_time;
+// When the foreground app needs its next regular frame (see RedrawInterval)
+static tick_t next_frame_tick;
+static bool next_frame_scheduled = false;  // Not for rdOnDemand apps
+
+tick_t sleep_time;
 bool auto_screen_off = true;
 uint auto_screen_off_interval = 10000; //systicks
 
+transition_t app_transition = trWipe;
+
 ////////// Prototypes //////////////////////////////////////////////////////////
 
 void ProcessCore();
 void DrawFrame();
 void DrawLoop();
+static bool PrerenderFrame();
+static void OnPowerChange();
 void DisplayBootScreen();
 void CheckButtons();
 
-void OnBTN1Change(bool btn_pressed);
-void OnBTN2Change(bool btn_pressed);
-void OnBTN3Change(bool btn_pressed);
-void OnBTN4Change(bool btn_pressed);
+static void OnBTN1Change(bool btn_pressed);
+static void OnBTN2Change(bool btn_pressed);
+static void OnBTN3Change(bool btn_pressed);
+static void OnBTN4Change(bool btn_pressed);
 
 ////////// Methods /////////////////////////////////////////////////////////////
 
@@ -78,40 +107,65 @@ void InitializeOS() {
     ClrWdt();
 
     // High priority tasks that must be run all the time
-    core_task = RegisterTask("Core", ProcessCore);
-    core_task->state = tsRun;
+    core_task = RegisterTask("Core", ProcessCore, prHigh, TASK_STACK_SIZE);
+
+    // Drawing, only needs to be run when screen is on (started by ScreenOn)
+    EventFlagsInit(&draw_events);
+    draw_task = RegisterTask("Draw", DrawLoop, prHigh, TASK_STACK_SIZE);
+    SetTaskState(draw_task, tsStop);
+
+    // Predictable frames are drawn ahead of time, when there's nothing else to do
+    KernelSetIdleHook(PrerenderFrame);
 
-    // Drawing, only needs to be run when screen is on
-    draw_task = RegisterTask("Draw", DrawLoop);
+    // Battery monitoring runs off a software timer
+    InitializePowerMonitor();
+    PowerMonitorSetCallback(OnPowerChange);
 
     // Initialize button interrupts
     _CNIEn(BTN1_CN) = 1;
     _CNIEn(BTN2_CN) = 1;
     _CNIEn(BTN3_CN) = 1;
     _CNIEn(BTN4_CN) = 1;
-    cn_register_cb(_CNIDX(BTN1_CN), _PINREF(BTN1), OnBTN1Change);
-    cn_register_cb(_CNIDX(BTN2_CN), _PINREF(BTN2), OnBTN2Change);
-    cn_register_cb(_CNIDX(BTN3_CN), _PINREF(BTN3), OnBTN3Change);
-    cn_register_cb(_CNIDX(BTN4_CN), _PINREF(BTN4), OnBTN4Change);
-
-    uint i;
-    for (i=1; i<=4; i++) {
-        btn_debounce_tick[i] = 0;
-        btn_state[i] = 0;
-    }
+    cn_register_isr_cb(_CNIDX(BTN1_CN), _PINREF(BTN1), OnBTN1Change);
+    cn_register_isr_cb(_CNIDX(BTN2_CN), _PINREF(BTN2), OnBTN2Change);
+    cn_register_isr_cb(_CNIDX(BTN3_CN), _PINREF(BTN3), OnBTN3Change);
+    cn_register_isr_cb(_CNIDX(BTN4_CN), _PINREF(BTN4), OnBTN4Change);
+
+    // The interrupt queues button changes for the core task
+    EventFlagsInit(&core_events);
+    InitializeInput(&core_events, CORE_EVT_INPUT);
 }
 
 static void reset_auto_screen_off() {
-    sleep_time = systick + auto_screen_off_interval;
+    sleep_time = GetTicks() + auto_screen_off_interval;
+}
+
+// Throw away any pre-rendered frame and draw a new one straight away
+void RequestRedraw() {
+    frame_generation++;
+    prerender_ready = false;
+    EventFlagsSet(&draw_events, DRAW_EVT_REDRAW);
+}
+
+// The status bar has changed
+static void OnPowerChange() {
+    if (displayOn)
+        RequestRedraw();
 }
 
 void ScreenOff() {
-    AppGlobalEvent(evtScreenOff, NULL);
+    AppGlobalEvent(evtScreenOff, 0);
 
     accel_SetMode(accStandby);
 
-    // Disable drawing
-    draw_task->state = tsStop;
+    // Disable drawing. The draw task stops itself between frames, so it
+    // never stops part way through pushing one (or holding a CPU boost).
+    if (draw_task->state != tsStop) {
+        EventFlagsSet(&draw_events, DRAW_EVT_STOP);
+        WaitFor(draw_task->state == tsStop);
+    }
+
+    PowerMonitorSetInterval(CORE_STANDBY_INTERVAL);
 
     /*if (foreground_app != NULL) {
         foreground_app->task->state = tsStop;
@@ -126,127 +180,162 @@ void ScreenOff() {
 }
 
 void ScreenOn() {
-    // Draw a frame before fading in
+    // Draw a frame before fading in.
+    // Powering on clears the display RAM, so it's pushed afterwards.
     DrawFrame();
     //_LAT(OL_POWER) = 1;
-    UpdateDisplay();
 
     ssd1351_PowerOn();
+    DisplayCleared();
+    BootStage("OLED power");
+
+    UpdateDisplay();
+    BootStage("First frame");
+
     ssd1351_DisplayOn();
+    BootStage("Fade in");
 
-    draw_task->state = tsRun;
+    SetTaskState(draw_task, tsRun);
 
-    AppGlobalEvent(evtScreenOn, NULL);
+    PowerMonitorSetInterval(CORE_PROCESS_INTERVAL);
 
-    displayOn = true;
+    AppGlobalEvent(evtScreenOn, 0);
+
+    // The core task can check this at any point, so only once it's all done
     reset_auto_screen_off();
+    displayOn = true;
 }
 
+// The boot tasks run concurrently, the last one to finish ends the boot
+static uint boot_tasks_running = 2;
 
-void ProcessCore() {
-    while (1) {
-        ProcessPowerMonitor();
-
-        // Reset debouncing when timeout period expires,
-        // to prevent lock-up when a roll-over occurrs.
-        uint i;
-        for (i=1; i<=4; i++) {
-            if (btn_debouncing[i] && systick >= btn_debounce_tick[i]) {
-                btn_debouncing[i] = false;
-            }
-        }
+static void BootTaskDone() {
+    uint ipl;
+    KernelEnterCritical(ipl);
+    bool last = (--boot_tasks_running == 0);
+    KernelExitCritical(ipl);
 
-        // Turn off screen automatically after some amount of time
-        if (auto_screen_off && displayOn && systick > sleep_time) {
-            ScreenOff();
-        }
-
-        if (displayOn)
-            Delay(CORE_PROCESS_INTERVAL);
-        else
-            Delay(CORE_STANDBY_INTERVAL);
-    }
+    if (last)
+        BootDone();
 }
 
-static void NextApp() {
-    if (current_app <= app_count-2) {
-        if (wipe_frame == 0) { //TODO: queue up events instead of ignoring
-            current_app++;
-            SetForegroundApp(installed_apps[current_app]);
+// Brings up the display. It mostly waits on the OLED, which lets AppBootTask run.
+static void DisplayBootTask() {
+    // The foreground app has to be ready before its first frame
+    InitializeApplication(foreground_app);
 
-            wipe_frame = +1;
-        }
-    }
+    printf("Initializing OLED\n");
+    ClearImage();
+    ScreenOn();
+    //DisplayBootScreen();
+
+    _LAT(LED1) = 0;
+    BootTaskDone();
 }
-static void PrevApp() {
-    if (current_app > 0) {
-        if (wipe_frame == 0) {
-            current_app--;
-            SetForegroundApp(installed_apps[current_app]);
 
-            wipe_frame = -1;
-        }
-    }
+// Initializes the rest of the apps (eg. probing the accelerometer) in the background
+static void AppBootTask() {
+    printf("Initializing apps:\n");
+    InitializeApplications();
+    BootTaskDone();
 }
 
-static inline void OnBTNChange(bool btn_pressed, uint btn) {
-    // Assumes btn 1..4
+void StartBootTasks() {
+    RegisterTask("BootD", DisplayBootTask, prHigh, TASK_STACK_SIZE);
+    RegisterTask("BootA", AppBootTask, prLow, TASK_STACK_SIZE);
+}
 
-    // De-bouncing
-    bool *state = &btn_state[btn];
-    uint *tick = &btn_debounce_tick[btn];
-    bool *debouncing = &btn_debouncing[btn];
 
-    if (*debouncing && systick < *tick) {
-        return; // Event occurred within debounce interval
+static void HandleInput(input_event_t* evt);
+static void Navigate();
+
+void ProcessCore() {
+    while (1) {
+        uint interval = (displayOn) ? CORE_PROCESS_INTERVAL : CORE_STANDBY_INTERVAL;
+        EventFlagsWait(&core_events, CORE_EVT_INPUT | CORE_EVT_WIPE_DONE, InputTimeout(interval));
+
+        // Presses during the boot are dropped, the screen is still coming
+        // on and the apps may not be initialized yet
+        input_event_t evt;
+        while (InputRead(&evt)) {
+            if (boot_done)
+                HandleInput(&evt);
+        }
+
+        Navigate();
+
+        // Turn off screen automatically after some amount of time
+        if (auto_screen_off && displayOn && TickReached(sleep_time)) {
+            ScreenOff();
+        }
     }
+}
 
-    // Change state
-    *state = btn_pressed;
-    *tick = systick + DEBOUNCE_INTERVAL;
-    *debouncing = true;
+// Switch apps by the navigation added up in pending_nav, once any wipe in
+// progress has finished
+static void Navigate() {
+    if (pending_nav == 0 || wipe_frame != 0 || app_count == 0)
+        return;
+
+    int target = (int)current_app + pending_nav;
+    pending_nav = 0;
+    if (target < 0)
+        target = 0;
+    if (target > (int)app_count - 1)
+        target = app_count - 1;
+    if (target == (int)current_app)
+        return;
+
+    wipe_frame = (target > (int)current_app) ? +1 : -1;
+    current_app = target;
+    SetForegroundApp(installed_apps[current_app]);
+    RequestRedraw();
+}
 
-    //printf("btn %d : %d\n", btn, btn_pressed);
+static void HandleInput(input_event_t* evt) {
+    static uint wake_btn = 0;   // Held since it turned the screen on, so it doesn't repeat
 
     reset_auto_screen_off();
 
-    // Event handling
-    if (btn_pressed) {
-        if (!displayOn) {
-            ScreenOn();
-        }
-        else {
-            switch (btn) {
-                case 1:
-                    break;
-                case 2:
-                    PrevApp();
-                    break;
-                case 3:
-                    NextApp();
-                    break;
-                case 4:
+    if (evt->type == evtBtnPress && !displayOn) {
+        ScreenOn();
+        wake_btn = evt->btn;
+    } else if (evt->type == evtBtnRelease && evt->btn == wake_btn) {
+        wake_btn = 0;
+    } else if (evt->type == evtBtnPress || (evt->type == evtBtnRepeat && evt->btn != wake_btn)) {
+        switch (evt->btn) {
+            case 2:
+                pending_nav--;
+                break;
+            case 3:
+                pending_nav++;
+                break;
+            case 4:
+                if (evt->type == evtBtnPress)
                     ScreenOff();
-                    break;
-            }
+                break;
         }
-
-        AppForegroundEvent(evtBtnPress, btn);
-    } else {
-        AppForegroundEvent(evtBtnRelease, btn);
     }
+
+    AppForegroundEvent(evt->type, evt->btn);
+
+    // The app may have changed what it shows
+    if (displayOn)
+        RequestRedraw();
 }
-void OnBTN1Change(bool btn_pressed) {
-    OnBTNChange(btn_pressed, 1);
+
+// Called from the pin-change interrupt, the core task handles them (see input.h)
+static void OnBTN1Change(bool btn_pressed) {
+    InputButtonChange(1, btn_pressed);
 }
-void OnBTN2Change(bool btn_pressed) {
-    OnBTNChange(btn_pressed, 2);
+static void OnBTN2Change(bool btn_pressed) {
+    InputButtonChange(2, btn_pressed);
 }
-void OnBTN3Change(bool btn_pressed) {
-    OnBTNChange(btn_pressed, 3);
+static void OnBTN3Change(bool btn_pressed) {
+    InputButtonChange(3, btn_pressed);
 }
-void OnBTN4Change(bool btn_pressed) {
-    OnBTNChange(btn_pressed, 4);
+static void OnBTN4Change(bool btn_pressed) {
+    InputButtonChange(4, btn_pressed);
 }
 
 
@@ -258,26 +347,15 @@ void BootPrintln(const char* s) {
 }
 
 void DisplayBootScreen() {
-    byte y = 8;
-    char s[10];
-    byte x;
-    uint32 i;
-
     ClrWdt();
     ClearImage();
 
     ClrWdt();
     BootPrintln("OLED Watch v1.0");
     //DrawString("Booting...", 8, y, WHITE); y += 10;
-
-    
-    
-    for (i=0; i<1000000; i++) { ClrWdt(); }
 }
 
-void DrawFrame() {
-    //_LAT(LED1) = 1;
-
+static void DrawBackground() {
     global_drawop = SRCCOPY;
     SetFontSize(1);
     SetFont(fonts.Stellaris);
@@ -285,11 +363,9 @@ void DrawFrame() {
     // Draw the wallpaper
     //DrawImage(0,0,wallpaper);
     ClearImage();
+}
 
-    // Draw foreground app
-    if (foreground_app != NULL)
-        foreground_app->draw();
-
+static void DrawStatusBar() {
     // Draw the battery bar
     uint8 w = mLerp(0,100, 0,DISPLAY_WIDTH, battery_level);
     color_t c = WHITE;
@@ -334,17 +410,185 @@ void DrawFrame() {
 //    DrawString(s, 4,5, DARKGREEN);
 }
 
-// Called periodically
+// Systicks from one regular frame to the next for an app, or 0 if it's only
+// redrawn on demand. Continuous apps are slowed down on a low battery.
+static uint RedrawInterval(application_t* app) {
+    if (app == NULL)
+        return DRAW_INTERVAL;
+
+    switch (app->redraw) {
+        case rdOnDemand:
+            return 0;
+        case rdSecond:
+            return SecondsToTicks(1);
+        case rdMinute:
+            return SecondsToTicks(60 - ClockNow().sec);
+        default: {
+            uint fps = (app->fps != 0) ? app->fps : 1000 / DRAW_INTERVAL;
+            bool low = (battery_status == batLow || battery_status == batFlat);
+            if (power_status == pwBattery && low && fps > LOW_BATTERY_FPS)
+                fps = LOW_BATTERY_FPS;
+            return SecondsToTicks(1) / fps;
+        }
+    }
+}
+
+// Called whenever a new frame goes up
+static void ScheduleNextFrame() {
+    uint interval = RedrawInterval(foreground_app);
+    next_frame_tick = GetTicks() + interval;
+    next_frame_scheduled = (interval != 0);
+}
+
+void DrawFrame() {
+    //_LAT(LED1) = 1;
+
+    // Always draw to the screen buffer, even if this pre-empted a pre-render
+    bool offscreen = DrawToOffscreen(false);
+    frame_generation++;
+    prerender_ready = false;
+
+    ScheduleNextFrame();
+
+    DrawBackground();
+
+    // Draw foreground app
+    if (foreground_app != NULL)
+        foreground_app->draw();
+
+    DrawStatusBar();
+
+    DrawToOffscreen(offscreen);
+}
+
+// Idle hook: draw the foreground app's next frame into the off-screen buffer,
+// so when it's due the draw task only has to push it to the display.
+static bool PrerenderFrame() {
+    application_t* app = foreground_app;
+    if (!displayOn || lock_display || wipe_frame != 0 || prerender_ready)
+        return false;
+    if (app == NULL || app->prerender == NULL)
+        return false;
+
+    uint generation = frame_generation;
+
+    bool offscreen = DrawToOffscreen(true);
+    DrawBackground();
+    tick_t tick = app->prerender();
+    DrawStatusBar();
+    DrawToOffscreen(offscreen);
+
+    // A regular frame drawn in the meantime makes this one stale (and the
+    // font and draw op are shared, so it may be garbled). Try again.
+    uint ipl;
+    KernelEnterCritical(ipl);
+    bool valid = (generation == frame_generation && app == foreground_app);
+    if (valid) {
+        prerender_app = app;
+        prerender_tick = tick;
+        prerender_ready = true;
+    }
+    KernelExitCritical(ipl);
+
+    if (!valid)
+        return true;
+
+    EventFlagsSet(&draw_events, DRAW_EVT_PRERENDERED);
+    return false;
+}
+
+// Systicks the draw task can wait before the next frame is due
+static uint NextFrameTimeout() {
+    tick_t due;
+    if (prerender_ready)
+        due = prerender_tick;
+    else if (next_frame_scheduled)
+        due = next_frame_tick;
+    else
+        return WAIT_FOREVER;
+
+    int32 ticks = TickDiff(due, GetTicks());
+    if (ticks <= 0)
+        return 0;
+    return (ticks < WAIT_FOREVER) ? ticks : WAIT_FOREVER - 1;
+}
+
+// Animate the switch to the frame just drawn. It's done a step at a time,
+// sleeping in between, so other tasks (eg. USB) keep running.
+// Returns false if it was cut short because the draw task has to stop.
+static bool RunTransition(int dir) {
+    bool done = true;
+
+    TransitionStart(app_transition, dir, TRANSITION_TIME, TRANSITION_FPS);
+    while (1) {
+        CpuBoostBegin();
+        uint wait = TransitionStep();
+        CpuBoostEnd();
+
+        if (wait == 0)
+            break;
+        if (EventFlagsWait(&draw_events, DRAW_EVT_STOP, wait)) {
+            TransitionCancel();
+            done = false;
+            break;
+        }
+    }
+
+    wipe_frame = 0;
+    if (pending_nav != 0)
+        EventFlagsSet(&core_events, CORE_EVT_WIPE_DONE);
+    return done;
+}
+
+// Called by the draw task when asked to stop (see ScreenOff).
+// ScreenOn starts it again from here.
+static void StopDrawing() {
+    SetTaskState(draw_task, tsStop);
+    Delay(0);
+}
+
+// Draws a frame whenever the foreground app's redraw policy says it's due,
+// or for apps that pre-render, shows each pre-rendered frame when it's due
+// instead (redrawing straight away on input)
 void DrawLoop() {
-    static uint scroll = 1;
-    
     while (1) {
-        uint t1, t2;
-        uint next_tick = systick + DRAW_INTERVAL;
+        tick_t t1, t2;
+
+        uint events = EventFlagsWait(&draw_events, DRAW_EVT_REDRAW | DRAW_EVT_PRERENDERED | DRAW_EVT_STOP, NextFrameTimeout());
 
-        t1 = systick;
+        if (events & DRAW_EVT_STOP) {
+            StopDrawing();
+            continue;
+        }
+
+        if (prerender_ready && !(events & DRAW_EVT_REDRAW)) {
+            if (!TickReached(prerender_tick))
+                continue;   // Not due yet
+
+            if (lock_display || wipe_frame != 0 || prerender_app != foreground_app) {
+                // Stale, fall back to a regular frame
+                prerender_ready = false;
+            } else {
+                // Already drawn, just push it out
+                CpuBoostBegin();
+                SwapScreenBuffers();
+                prerender_ready = false;
+                ScheduleNextFrame();
+                UpdateDisplay();
+                CpuBoostEnd();
+                continue;
+            }
+        } else if (!(events & DRAW_EVT_REDRAW)) {
+            if (!next_frame_scheduled || !TickReached(next_frame_tick))
+                continue;   // Woken early, or by a pre-render that went stale
+        }
+
+        t1 = GetTicks();
 
         if (!lock_display) {
+            // Get the frame out as quickly as possible
+            CpuBoostBegin();
+
             display_frame_ready = false;
 
             DrawFrame();
@@ -355,19 +599,22 @@ void DrawLoop() {
                 //_LAT(LED1) = 1;
                 UpdateDisplay();
                 //_LAT(LED1) = 0;
-            } else {
-                // Blocking call
-                UpdateDisplayWipeIn(wipe_frame);
-                wipe_frame = 0;
             }
-        }
 
-        t2 = systick;
-        draw_ticks = (t2 >= t1) ? (t2 - t1) : 0;
+            CpuBoostEnd();
+
+            if (wipe_frame != 0 && !RunTransition(wipe_frame)) {
+                StopDrawing();
+                continue;
+            }
+        } else {
+            // Skip this frame, but keep to the schedule so the wait blocks
+            // until the next one (CMD_DISPLAY_UNLOCK redraws straight away)
+            ScheduleNextFrame();
+        }
 
-        Delay(DRAW_INTERVAL);
-        //WaitUntil(next_tick);
-        //Delay(0);
+        t2 = GetTicks();
+        draw_ticks = t2 - t1;
     }
 }
 
@@ -11,6 +11,7 @@
 #define	OS_H
 
 #include "api/app.h"
+#include "api/graphics/gfx.h"
 
 #define DRAW_INTERVAL 100
 //#define PROCESS_CORE_INTERVAL 250
@@ -19,17 +20,31 @@
 #define CORE_PROCESS_INTERVAL 50    // Update rate when screen is on
 #define CORE_STANDBY_INTERVAL 250   // Update rate when screen is off (standby)
 
+#define TRANSITION_TIME 250         // App switch animation length (systicks)
+#define TRANSITION_FPS 30           // and frame rate
+
 extern volatile bool lock_display;              // Prevent the OS from drawing to the image buffer
 extern volatile bool display_frame_ready;       // True if the display has a fully drawn frame
 
 extern bool auto_screen_off;                    // If true, screen will automatically turn off
 extern uint auto_screen_off_interval;           // Number of systicks before screen will automatically turn off
 
+extern transition_t app_transition;             // Animation when switching apps
+
 void InitializeOS();
 
+// Register the tasks that finish the boot once the kernel starts: one turns
+// the screen on, the other initializes the installed apps. Buttons are
+// ignored until both are done (see boot_done).
+void StartBootTasks();
+
 // Set the specified app to be the foreground process
 void SetForegroundApp(application_t* app);
 
+// Redraw the foreground app as soon as possible (eg. from an rdOnDemand
+// app when what it shows has changed)
+void RequestRedraw();
+
 void ScreenOff();
 void ScreenOn();
 void DisplayBootScreen();
@@ -216,7 +216,8 @@ void accel_RegisterCallback(accel_mode_t mode, proc_t cb) {
 // INT1 signifies different events depending on mode.
 // In mmaMeasure mode, INT1 is the DRDY status bit, signifying data is ready to be read
 
-void accel_isr() {
+// Deferred from accel_isr(), since it needs to talk over I2C
+static void accel_HandleInterrupt(uint param) {
 
     //TODO: Do we need to modify the INTREG bits (swap INT1/INT2 pin status) depending on mode??
     // The hardware is configured to use only one interrupt
@@ -254,3 +255,6 @@ void accel_isr() {
     if (cb != NULL) cb();
 }
 
+void accel_isr() {
+    KernelDefer(accel_HandleInterrupt, 0);
+}
@@ -9,6 +9,7 @@
 
 #include <system.h>
 #include "hardware.h"
+#include "core/kernel.h"
 #include "ssd1351.h"
 #include "peripherals/ssd1351p.h"
 #include "api/graphics/gfx.h"
@@ -64,6 +65,10 @@
 #define CMD_STOP_MOVING             0x9E    // Stop horizontal scroll
 #define CMD_START_MOVING            0x9F    // Start horizontal scroll
 
+// Delays (ms). These sleep once the kernel has started (see DelayOrSpin).
+#define RESET_DELAY                 50      // OL_RESET pulse, and settling time afterwards
+#define FADE_STEP_DELAY             10      // Each of the 15 master contrast steps when fading in/out
+
 /*const uint8 gamma_lut[] = {
     0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
     0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11,
@@ -129,14 +134,12 @@ void ssd1351_PowerOn() {
     //return;
    // ssd1351_write(0xAA);
     //return;
-    UINT32 i;
-    
     //_LAT(OL_RESET) = 1;
     //for (i=0; i<10000; i++) { ClrWdt(); }
     _LAT(OL_RESET) = 0;
-    for (i=0; i<100000; i++) { ClrWdt(); }
+    DelayOrSpin(RESET_DELAY);
     _LAT(OL_RESET) = 1;
-    for (i=0; i<100000; i++) { ClrWdt(); }
+    DelayOrSpin(RESET_DELAY);
 
 
     // Unlock locked commands
@@ -193,10 +196,10 @@ void ssd1351_DisplayOn() {
 
     ssd1351_command(CMD_DISPLAY_ON);
 
-    UINT i,j;
+    UINT i;
     for (i=0; i<0x0F; i++) {
         ssd1351_sendv(CMD_MASTER_CONTRAST, 1, i);
-        for (j=0; j<40000; j++);
+        DelayOrSpin(FADE_STEP_DELAY);
     }
 }
 
@@ -209,10 +212,10 @@ void ssd1351_PowerOff() {
 }
 
 void ssd1351_DisplayOff() {
-    UINT i,j;
+    UINT i;
     for (i=0; i<0x0F; i++) {
         ssd1351_sendv(CMD_MASTER_CONTRAST, 1, 0x0F - i);
-        for (j=0; j<40000; j++);
+        DelayOrSpin(FADE_STEP_DELAY);
     }
 
     ssd1351_command(CMD_DISPLAY_OFF);
@@ -260,6 +263,44 @@ void ssd1351_UpdateScreen(__eds__ color_t* buf, uint size) {
     ssd1351_writeimgbuf(buf, size);
 }
 
+static void SetWindow(uint x, uint y, uint w, uint h) {
+    // The RAM address wraps around within the window, so each row of the
+    // window follows straight on from the last
+    ssd1351_command(CMD_WRITE_RAM);
+    ssd1351_sendv(CMD_SET_COLUMN_ADDR, 2, x, x+w-1);
+    ssd1351_sendv(CMD_SET_ROW_ADDR, 2, y, y+h-1);
+    ssd1351_command(CMD_WRITE_RAM);
+}
+
+void ssd1351_UpdateWindow(__eds__ color_t* buf, uint x, uint y, uint w, uint h) {
+    ssd1351_CopyWindow(buf, x, x, y, w, h);
+}
+
+void ssd1351_CopyWindow(__eds__ color_t* buf, uint src_x, uint x, uint y, uint w, uint h) {
+    SetWindow(x, y, w, h);
+
+    buf += src_x + (y * DISPLAY_WIDTH);
+    if (w == DISPLAY_WIDTH) {
+        ssd1351_writeimgbuf(buf, w * h);
+    } else {
+        uint i;
+        for (i=0; i<h; i++) {
+            ssd1351_writeimgbuf(buf, w);
+            buf += DISPLAY_WIDTH;
+        }
+    }
+}
+
+void ssd1351_FillWindow(uint x, uint y, uint w, uint h, color_t c) {
+    SetWindow(x, y, w, h);
+
+    uint i;
+    for (i=0; i<w*h; i++) {
+        ssd1351_data((c & 0xFF00) >> 8);
+        ssd1351_data(c & 0x00FF);
+    }
+}
+
 void ssd1351_HorizontalScroll(int8 dir) {
     ssd1351_sendv(CMD_HORIZONTAL_SCROLL, 5,
             dir,                  // Scroll direction (+1 or -1)
@@ -279,52 +320,3 @@ void ssd1351_SetRowAddressing() {
 void ssd1351_SetColumnAddressing() {
     ssd1351_send(CMD_COLORDEPTH, COLOURDEPTH_CFG | 1);
 }
-
-void ssd1351_WipeIn(__eds__ color_t* buf, int dir) {
-    static uint x = 0;
-    uint y;
-    color_t c;
-
-
-    ssd1351_SetColumnAddressing();
-
-#define LINE_WIDTH 2
-
-    // Draw the initial line
-    for (x=0; x<LINE_WIDTH; x++) {
-        c = SKYBLUE;
-        ssd1351_SetCursor((dir > 0) ? x : (DISPLAY_WIDTH-x-1), 0);
-        for (y=0; y<DISPLAY_HEIGHT; y++) {
-            ssd1351_data((byte)(c>>8));
-            ssd1351_data((byte)(c));
-        }
-    }
-
-    // Wipe in
-    for (x=0; x<DISPLAY_WIDTH; x++) {
-        // Draw the line
-        if (x < DISPLAY_WIDTH-LINE_WIDTH) {
-            c = SKYBLUE;
-            ssd1351_SetCursor((dir > 0) ? (x+LINE_WIDTH) : (DISPLAY_WIDTH-x-LINE_WIDTH-1), 0);
-            for (y=0; y<DISPLAY_HEIGHT; y++) {
-                ssd1351_data((byte)(c>>8));
-                ssd1351_data((byte)(c));
-            }
-        }
-
-        // Draw the buffer contents
-//        __eds__ color_t *c1 = &buf[x*DISPLAY_WIDTH];
-        ssd1351_SetCursor((dir > 0) ? x : (DISPLAY_WIDTH-x-1), 0);
-        for (y=0; y<DISPLAY_HEIGHT; y++) {
-            c = (dir > 0) ? buf[x+y*DISPLAY_WIDTH] : buf[(DISPLAY_WIDTH-x-1)+y*DISPLAY_WIDTH];
-            ssd1351_data((byte)(c>>8));
-            ssd1351_data((byte)(c));
-        }
-        
-        //Delay(1);
-    }
-    ssd1351_SetRowAddressing();
-    
-    if (x == DISPLAY_WIDTH)
-        x = 0;
-}
\ No newline at end of file
@@ -41,6 +41,15 @@ extern void ssd1351_ClearScreen();
 // Draw pixels to the screen
 void ssd1351_UpdateScreen(__eds__ uint16 *buf, uint size);
 
+// Draw a w x h window of a full screen buffer to the same place on the screen
+void ssd1351_UpdateWindow(__eds__ uint16 *buf, uint x, uint y, uint w, uint h);
+
+// Same, but the window is taken from column src_x of the buffer
+void ssd1351_CopyWindow(__eds__ uint16 *buf, uint src_x, uint x, uint y, uint w, uint h);
+
+// Fill a w x h window of the screen with a colour
+void ssd1351_FillWindow(uint x, uint y, uint w, uint h, color_t c);
+
 // Set the current cursor position
 void ssd1351_SetCursor(uint x, uint y) ;
 
@@ -20,6 +20,8 @@
 
 #define CONNECTION_TIMEOUT 500
 
+#define USB_EVT_TRANSFER 0x01
+
 ////////// Global Variables ////////////////////////////////////////////////////
 
 //char USB_In_Buffer[64];
@@ -37,14 +39,28 @@ USB_HANDLE USBInHandle = 0; //USB handle.  Must be initialized to 0 at startup.
 static proc_t on_usb_sleep = NULL;
 static proc_t on_usb_wake = NULL;
 static bool connected = false;
-static uint connection_timeout = 0;
+static volatile tick_t connection_timeout = 0; // Written from the USB interrupt
+
+// Disconnects when the host stops talking to us
+static coroutine_t* timeout_co;
+
+// Set from the USB interrupt, so the comms task can sleep until there's data
+static event_flags_t usb_events;
 
 ////////// Methods /////////////////////////////////////////////////////////////
 
+static void usb_timeout_co(coroutine_t* co);
+
 void InitializeUSB(proc_t usb_sleep_cb, proc_t usb_wake_cb) {
     // Enable USB peripheral
     _USB1MD = 0;
 
+    EventFlagsInit(&usb_events);
+
+    // Only runs while connected (see usb_connect)
+    timeout_co = RegisterCoroutine(usb_timeout_co);
+    CoroutineStop(timeout_co);
+
     // Required for the USB device to enumerate
     _CNPUE(USB_DPLUS_CN) = 1;
 
@@ -67,12 +83,21 @@ void InitializeUSB(proc_t usb_sleep_cb, proc_t usb_wake_cb) {
 }
 
 static void usb_reset_timeout() {
-    connection_timeout = systick + CONNECTION_TIMEOUT;
+    connection_timeout = GetTicks() + CONNECTION_TIMEOUT;
+}
+static tick_t usb_get_timeout() {
+    // The interrupt may update the timeout between reading its two words
+    uint ipl;
+    KernelEnterCritical(ipl);
+    tick_t timeout = connection_timeout;
+    KernelExitCritical(ipl);
+    return timeout;
 }
 static void usb_connect() {
     if (!connected) {
         connected = true;
         usb_reset_timeout();
+        CoroutineStart(timeout_co);
         if (on_usb_wake != NULL)
             on_usb_wake();
     }
@@ -80,25 +105,24 @@ static void usb_connect() {
 static void usb_disconnect() {
     if (connected) {
         connected = false;
+        CoroutineStop(timeout_co);
         if (on_usb_sleep != NULL)
             on_usb_sleep();
     }
 }
-static void usb_check_timeout() {
-    // Prevent systick roll-over issues
-    if (connection_timeout < CONNECTION_TIMEOUT + 1) {
-        usb_reset_timeout();
-        return;
-    }
+static void usb_timeout_co(coroutine_t* co) {
+    CoBegin(co);
 
-    if (systick > connection_timeout) {
-        usb_disconnect();
-    }
+    // The timeout is pushed back by every USB event
+    while (!TickReached(usb_get_timeout()))
+        CoWaitUntil(co, usb_get_timeout());
+
+    usb_disconnect();
+
+    CoEnd(co);
 }
 
 void USBProcess(usb_rx_packet_cb receive_callback) {
-    usb_check_timeout();
-
     if ((USBDeviceState < CONFIGURED_STATE) || (USBSuspendControl == 1)) {
         return;
     }
@@ -119,6 +143,11 @@ void USBSendPacket(unsigned char* packet) {
     }
 }
 
+void USBWait(uint timeout) {
+    // Block until a USB transfer completes, or the timeout expires
+    EventFlagsWait(&usb_events, USB_EVT_TRANSFER, timeout);
+}
+
 BOOL USBBusy() {
     if ((USBDeviceState < CONFIGURED_STATE) || (USBSuspendControl == 1)) return false;
     return HIDRxHandleBusy(USBOutHandle) || HIDTxHandleBusy(USBInHandle);
@@ -271,7 +300,7 @@ BOOL USER_USB_CALLBACK_EVENT_HANDLER(int event, void *pdata, WORD size) {
 
     switch (event) {
         case EVENT_TRANSFER:
-            //Add application specific callback task or callback function here if desired.
+            EventFlagsSet(&usb_events, USB_EVT_TRANSFER);
             break;
         case EVENT_SOF:
             USBCB_SOF_Handler();
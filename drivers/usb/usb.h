@@ -22,6 +22,7 @@ typedef void (*usb_rx_packet_cb)(unsigned char* packet);
 
 void USBProcess(usb_rx_packet_cb receive_callback);
 void USBSendPacket(unsigned char* packet);
+void USBWait(uint timeout);
 BOOL USBBusy();
 
 #endif	/* USB_H */
@@ -38,6 +38,7 @@
 #include "core/kernel.h"
 #include "core/os.h"
 #include "core/cpu.h"
+#include "core/boot.h"
 
 // Peripherals
 #include "peripherals/adc.h"
@@ -83,11 +84,14 @@ void Initialize() {
     adc_init();
     adc_enable();
 
+    // The boot is timed from here, once the SOSC is running (T1 runs from it)
     InitializeClock();
     InitializeKernel();
+    InitializeCpuGovernor();
     InitializeComms();
     //InitializeOled();
     InitializeOS();
+    BootStage("Core");
 
     printf("Zeitgeber (OLED Watch r2)\n");
 
@@ -122,14 +126,6 @@ void Initialize() {
         }
     }
     RCON &= ~RCON_RESET;
-
-
-    printf("Initializing OLED\n");
-    ClearImage();
-    ScreenOn();
-    //DisplayBootScreen();
-
-    _LAT(LED1) = 0;
 }
 
 int main() {
@@ -141,18 +137,18 @@ int main() {
     RegisterUserApplication(&appimu);
     RegisterUserApplication(&appkdiag);
 
-    ClrWdt();
-    printf("Initializing apps:\n");
-    InitializeApplications();
-
-    ClrWdt();
-    printf("Starting the kernel\n");
     SetForegroundApp(&appclock);
     //SetForegroundApp(&apptest);
     //SetForegroundApp(&appimu);
     current_app = 1;
 
+    // The rest of the bring-up runs under the kernel, so the display's
+    // delays don't hold up everything else
+    StartBootTasks();
+
     ClrWdt();
+    printf("Starting the kernel\n");
+    BootStage("Kernel start");
     KernelStart();
     return 0;
 }
@@ -20,6 +20,7 @@
 #define USE_AND_OR
 #include <adc.h>
 #include "adc.h"
+#include "core/kernel.h"
 
 ////////// Defines /////////////////////////////////////////////////////////////
 
@@ -120,6 +121,14 @@ void adc_Calibrate() {
 }*/
 
 
+static void adc_dispatch(uint channel) {
+    // Deferred from _ADC1Interrupt: param is the channel that finished
+    volatile adc_channel_t* ch = &adc_channels[channel];
+    adc_conversion_cb callback = ch->callback;
+    if (callback != NULL)
+        callback(ch->voltage);
+}
+
 void adc_SetCallback(uint8 channel, adc_conversion_cb callback) {
     //adc_callbacks[channel] = callback;
     adc_channels[channel].callback = callback;
@@ -164,6 +173,7 @@ uint adc_Read(uint8 channel) {
 ////////// Interrupts //////////////////////////////////////////////////////////
 
 void isr _ADC1Interrupt() {
+    KernelIsrEnter(kiADC);
     _AD1IF = 0;
 
     // ADC alternates between mux A and mux B,
@@ -179,8 +189,8 @@ void isr _ADC1Interrupt() {
     vdd = VBG_VOLTAGE * 1024UL / (unsigned long)ch->abg;
     ch->voltage = (unsigned long)vdd * (unsigned long)ch->ach / 1024;
 
-    // ADC Conversion Callback
-    if (ch->callback != NULL) ch->callback(ch->voltage);
+    // ADC Conversion Callback (deferred to task context)
+    if (ch->callback != NULL) KernelDefer(adc_dispatch, current_channel);
 
     AD1CON1bits.ASAM = 0;
     //AD1CON1bits.SAMP = 0;
@@ -199,5 +209,7 @@ void isr _ADC1Interrupt() {
     }
     if (!test) adc_disable();
 #endif
+
+    KernelIsrExit(kiADC);
 }
 
@@ -46,7 +46,7 @@ uint adc_Read(uint8 channel);
 void adc_SetBandgap(bool enabled);
 
 // Optionally register a callback for the ADC channel. Set to NULL to disable callback
-// WARNING: Called from within an ISR, take care to make sure it's thread-safe!
+// Called from the kernel's worker task once the conversion finishes (not from the ISR)
 extern void adc_SetCallback(uint8 channel, adc_conversion_cb callback);
 
 // Start conversion on the specified channel
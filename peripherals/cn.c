@@ -9,21 +9,27 @@
 #include "hardware.h"
 #include "peripherals/gpio.h"
 #include "peripherals/cn.h"
+#include "core/kernel.h"
 
 typedef struct {
     uint cn_pin;            // eg. CN1
     pinref_t pinref;
 
     cn_cb callback;
+    bool in_isr;            // Call straight from the interrupt instead of deferring
     bool state;
 } cn_info_t;
 
 static cn_info_t cn_pins[NUM_CN_PINS];
 static uint cn_pin_count = 0;
 
+static void cn_dispatch(uint param) {
+    // Deferred from _CNInterrupt: param is the pin index and new state
+    cn_pins[param >> 1].callback(param & 1);
+}
 
-// Register a pin-change interrupt callback
-void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
+
+static void cn_register(uint cn_pin, pinref_t pinref, cn_cb callback, bool in_isr) {
     if (cn_pin < NUM_CN_PINS) {
         // Assign callback
         cn_info_t* info = &cn_pins[cn_pin_count++];
@@ -31,6 +37,7 @@ void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
         info->cn_pin = cn_pin;
         info->pinref = pinref;
         info->callback = callback;
+        info->in_isr = in_isr;
 
         // Configure pin as input
 
@@ -48,12 +55,22 @@ void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
     }*/
 }
 
+// Register a pin-change interrupt callback
+void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
+    cn_register(cn_pin, pinref, callback, false);
+}
+
+void cn_register_isr_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
+    cn_register(cn_pin, pinref, callback, true);
+}
+
 
 
 
 
 // Global pin-change interrupt handler
 void isr _CNInterrupt() {
+    KernelIsrEnter(kiCN);
     _CNIF = 0;
 
     // Determine which pin changed
@@ -64,8 +81,14 @@ void isr _CNInterrupt() {
         bool new_state = gpio_read(&info->pinref);
         if (info->state != new_state) {
             info->state = new_state;
-            info->callback(new_state);
+
+            // Run the callback in task context, unless it asked for the interrupt
+            if (info->in_isr)
+                info->callback(new_state);
+            else
+                KernelDefer(cn_dispatch, (i << 1) | new_state);
         }
     }
 
+    KernelIsrExit(kiCN);
 }
@@ -11,7 +11,12 @@
 typedef void (*cn_cb)(bool value);
 
 // Register a pin-change interrupt callback
+// (called from the kernel's worker task, not the interrupt)
 void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback);
 
+// Register a callback that is called from the interrupt itself.
+// Keep it short (eg. just queue the change).
+void cn_register_isr_cb(uint cn_pin, pinref_t pinref, cn_cb callback);
+
 #endif	/* CN_H */
 
@@ -12,13 +12,14 @@
 #include "system.h"
 #include "hardware.h"
 #include "peripherals/i2c.h"
+#include "core/cpu.h"
 
 ////////// Defines /////////////////////////////////////////////////////////////
 
 // I2C clock frequency (Hz)
 #define FSCL 100000
 
-#define BRGVAL (((POSC/2)/FSCL) - ((POSC/2)/10000000)-1)
+#define BRGVAL(fcy) (((fcy)/FSCL) - ((fcy)/10000000)-1)
 
 #define I2C_BUS_IDLE                0b000000
 #define I2C_SENDING_START           0b000001    // CON.SEN
@@ -48,7 +49,7 @@ void i2c_init() {
     // Set up I2C
     I2C2CON = 0x0000;
     I2C2STAT = 0x0000;
-    I2C2BRG = BRGVAL;
+    I2C2BRG = BRGVAL(CpuFcy());
 
     I2C2CONbits.I2CEN = 1;
 
@@ -56,6 +57,11 @@ void i2c_init() {
     //...
 }
 
+void i2c_set_clock(uint32 fcy) {
+    if (!_I2C2MD)
+        I2C2BRG = BRGVAL(fcy);
+}
+
 void i2c_start() {
     while (i2c_state() != 0);
 
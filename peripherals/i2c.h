@@ -16,6 +16,8 @@
 ////////// Methods /////////////////////////////////////////////////////////////
 
 void i2c_init();
+// Update the baud rate for a new instruction clock (see CpuSetSpeed)
+void i2c_set_clock(uint32 fcy);
 
 void i2c_start();
 void i2c_repeated_restart();
@@ -0,0 +1,195 @@
+/*
+ * File:   bench.c
+ * Author: Jared
+ *
+ * Scheduler benchmark for the posix port.
+ *
+ * Runs N synthetic periodic tasks (mixed priorities and periods, about half
+ * the CPU in total) for a fixed amount of virtual time, then reports the
+ * scheduling overhead and how accurately each priority hit its deadlines.
+ *
+ * Usage: bench [tasks] [seconds]
+ * With no task count it runs 8, 16 and 32 tasks, each in its own process
+ * (the kernel can only be started once).
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "system.h"
+#include "core/kernel.h"
+#include "port.h"
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+#define MAX_SYNTHETIC_TASKS (MAX_TASKS - 3) // idle, Work and the reporter
+#define TARGET_LOAD 500         // Total CPU used by the synthetic tasks (0.1% units)
+
+static const uint periods[] = { 4, 8, 16, 32, 64 }; // systicks
+#define NUM_PERIODS (sizeof(periods) / sizeof(periods[0]))
+
+static const task_priority_t priorities[] = { prHigh, prNormal, prLow };
+#define NUM_CLASSES 3
+
+typedef struct {
+    task_t* task;
+    uint period;            // systicks
+    uint32 work;            // T1 counts per period
+    uint class;             // Index into priorities[]
+    unsigned long runs;
+    unsigned long misses;   // Still running when the next period started
+    unsigned long long total_lateness;
+    uint32 max_lateness;    // T1 counts
+} synthetic_t;
+
+static synthetic_t synthetic[MAX_SYNTHETIC_TASKS];
+static uint num_synthetic;
+static uint duration;       // systicks
+
+extern task_t* current_task;
+extern uint16 stack_base;
+
+////////// Methods /////////////////////////////////////////////////////////////
+
+static synthetic_t* FindSynthetic() {
+    uint i;
+    for (i=0; i<num_synthetic; i++) {
+        if (synthetic[i].task == current_task)
+            return &synthetic[i];
+    }
+    return NULL;
+}
+
+static void SyntheticTask() {
+    synthetic_t* s = FindSynthetic();
+    tick_t next = GetTicks();
+
+    while (1) {
+        next += s->period;
+        WaitUntil(next);
+
+        // Lateness is measured from the start of the tick the task was due
+        uint32 late = KernelTimestamp() - next * SYSTICK_TMR_PERIOD;
+        s->runs++;
+        s->total_lateness += late;
+        if (late > s->max_lateness)
+            s->max_lateness = late;
+        if (late >= (uint32)s->period * SYSTICK_TMR_PERIOD)
+            s->misses++;
+
+        PortBusy(s->work);
+    }
+}
+
+static double CountsToUs(unsigned long long counts) {
+    return counts * 1e6 / 32768.0;
+}
+
+static void Report() {
+    // Skip the first second so every task has settled into its period
+    Delay(1000);
+    PortResetStats();
+    uint i;
+    for (i=0; i<num_synthetic; i++) {
+        synthetic_t* s = &synthetic[i];
+        s->runs = s->misses = 0;
+        s->total_lateness = 0;
+        s->max_lateness = 0;
+        KernelResetLatency(s->task);
+    }
+    unsigned long long start = port_stats.clock;
+
+    Delay(duration);
+
+    double seconds = (port_stats.clock - start) / 32768.0;
+    printf("%2u tasks, %.0fs virtual: load %u.%u%%, %lu T1 interrupts (%.1f%% fast path), %lu switches (%.0f/s)\n",
+            num_synthetic, seconds, total_cpu_usage / 10, total_cpu_usage % 10,
+            port_stats.systicks, 100.0 * port_stats.fast_ticks / port_stats.systicks,
+            port_stats.switches, port_stats.switches / seconds);
+    printf("  KernelSwitchTask: %.0f ns mean, %lu ns max (host)\n",
+            (double)port_stats.switch_ns / port_stats.switches, port_stats.max_switch_ns);
+
+    uint c;
+    for (c=0; c<NUM_CLASSES; c++) {
+        unsigned long runs = 0, misses = 0;
+        unsigned long long total = 0;
+        uint32 max = 0, max_latency = 0;
+
+        for (i=0; i<num_synthetic; i++) {
+            synthetic_t* s = &synthetic[i];
+            if (s->class != c)
+                continue;
+            runs += s->runs;
+            misses += s->misses;
+            total += s->total_lateness;
+            if (s->max_lateness > max)
+                max = s->max_lateness;
+            if (s->task->max_latency > max_latency)
+                max_latency = s->task->max_latency;
+        }
+        if (runs == 0)
+            continue;
+
+        printf("  priority %u: %6lu runs, lateness %7.1f us mean, %7.1f us max, wakeup latency %7.1f us max, %lu missed\n",
+                priorities[c], runs, CountsToUs(total) / runs, CountsToUs(max),
+                CountsToUs(max_latency), misses);
+    }
+
+    fflush(stdout);
+    exit(0);
+}
+
+static int RunBenchmark(uint n, uint seconds) {
+    if (n > MAX_SYNTHETIC_TASKS)
+        n = MAX_SYNTHETIC_TASKS;
+    num_synthetic = n;
+    duration = seconds * 1000;
+
+    // Simulated data space for the task stacks
+    stack_base = 0x1000;
+    SPLIM = PORT_RAM_SIZE - 0x1000;
+
+    InitializeKernel();
+
+    uint i;
+    for (i=0; i<n; i++) {
+        synthetic_t* s = &synthetic[i];
+        char name[TASK_NAME_LEN+1];
+        snprintf(name, sizeof(name), "syn%u", i);
+
+        s->class = i % NUM_CLASSES;
+        s->period = periods[(i / NUM_CLASSES) % NUM_PERIODS];
+        s->work = (uint32)TARGET_LOAD * s->period * SYSTICK_TMR_PERIOD / 1000 / n;
+        s->task = RegisterTask(name, SyntheticTask, priorities[s->class], TASK_STACK_SIZE);
+    }
+
+    RegisterTask("report", Report, prRealtime, TASK_STACK_SIZE);
+
+    KernelStart();
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    uint seconds = (argc > 2) ? atoi(argv[2]) : 10;
+
+    if (argc > 1)
+        return RunBenchmark(atoi(argv[1]), seconds);
+
+    static const uint counts[] = { 8, 16, 32 };
+    uint i;
+    for (i=0; i<sizeof(counts)/sizeof(counts[0]); i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+            return RunBenchmark(counts[i], seconds);
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * File:   GenericTypeDefs.h
+ * Author: Jared
+ *
+ * Host stand-in for the Microchip type definitions.
+ * Sizes match XC16 (int is 16 bits), so kernel arithmetic wraps the same way.
+ */
+
+#ifndef GENERICTYPEDEFS_H
+#define	GENERICTYPEDEFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint16_t UINT;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint8_t BOOL;
+
+#define TRUE 1
+#define FALSE 0
+
+typedef union { BYTE Val; struct { unsigned b0:1,b1:1,b2:1,b3:1,b4:1,b5:1,b6:1,b7:1; } bits; } BYTE_VAL;
+typedef union { WORD Val; BYTE v[2]; struct { BYTE LB; BYTE HB; } byte; } WORD_VAL;
+typedef union { DWORD Val; WORD w[2]; BYTE v[4]; struct { WORD LW; WORD HW; } word; } DWORD_VAL;
+
+#endif	/* GENERICTYPEDEFS_H */
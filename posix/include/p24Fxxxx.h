@@ -0,0 +1,108 @@
+/*
+ * File:   p24Fxxxx.h
+ * Author: Jared
+ *
+ * Host stand-in for the device header. Only the registers the kernel
+ * touches are simulated (see port.c).
+ */
+
+#ifndef P24FXXXX_H
+#define	P24FXXXX_H
+
+#include "port.h"
+
+// XC16 qualifiers and attributes that have no host equivalent
+#define __eds__
+#define space(x)
+#define near
+#define auto_psv
+#define interrupt
+#define shadow
+
+// Inline assembly (eg. Reset()) aborts with the instruction text
+extern void PortAsm(const char* s);
+#define asm(s) PortAsm(s)
+
+////////// Registers ///////////////////////////////////////////////////////////
+
+// Bit views alias the register words, like the real SFRs
+#define _SFR_BITS(name) (*(volatile name##BITS*)&name)
+
+#define _BITS16(p) struct { unsigned short p##0:1, p##1:1, p##2:1, p##3:1, p##4:1, p##5:1, p##6:1, p##7:1, \
+                                           p##8:1, p##9:1, p##10:1, p##11:1, p##12:1, p##13:1, p##14:1, p##15:1; }
+
+// TRISx, PORTx, LATx and ANSx for each I/O port
+#define _IO_PORT(x) \
+    typedef _BITS16(TRIS##x) TRIS##x##BITS; \
+    typedef _BITS16(R##x) PORT##x##BITS; \
+    typedef _BITS16(LAT##x) LAT##x##BITS; \
+    extern volatile unsigned short TRIS##x, PORT##x, LAT##x, ANS##x;
+
+_IO_PORT(B)
+_IO_PORT(C)
+_IO_PORT(D)
+_IO_PORT(E)
+_IO_PORT(F)
+_IO_PORT(G)
+
+#define TRISBbits _SFR_BITS(TRISB)
+#define TRISCbits _SFR_BITS(TRISC)
+#define TRISDbits _SFR_BITS(TRISD)
+#define TRISEbits _SFR_BITS(TRISE)
+#define TRISFbits _SFR_BITS(TRISF)
+#define TRISGbits _SFR_BITS(TRISG)
+#define PORTBbits _SFR_BITS(PORTB)
+#define PORTCbits _SFR_BITS(PORTC)
+#define PORTDbits _SFR_BITS(PORTD)
+#define PORTEbits _SFR_BITS(PORTE)
+#define PORTFbits _SFR_BITS(PORTF)
+#define PORTGbits _SFR_BITS(PORTG)
+#define LATBbits _SFR_BITS(LATB)
+#define LATCbits _SFR_BITS(LATC)
+#define LATDbits _SFR_BITS(LATD)
+#define LATEbits _SFR_BITS(LATE)
+#define LATFbits _SFR_BITS(LATF)
+#define LATGbits _SFR_BITS(LATG)
+
+typedef struct { unsigned short :15, TON:1; } T1CONBITS;
+typedef struct { unsigned short :5, PLLEN:1, CPDIV:2, :8; } CLKDIVBITS;
+typedef struct { unsigned short :5, SWDTEN:1, :10; } RCONBITS;
+
+extern volatile unsigned short TMR1, PR1, T1CON;
+extern volatile unsigned short CLKDIV, RCON, SPLIM;
+extern volatile unsigned short PMD1, PMD2, PMD3, PMD4, PMD5, PMD6;
+
+#define T1CONbits _SFR_BITS(T1CON)
+#define CLKDIVbits _SFR_BITS(CLKDIV)
+#define RCONbits _SFR_BITS(RCON)
+#define _CPDIV CLKDIVbits.CPDIV
+
+// Individual bits are plain variables
+extern volatile unsigned short _T1IF, _T1IE, _T1IP, _T1MD;
+extern volatile unsigned short _SESVD;  // USB VBUS session valid
+extern volatile unsigned short _CN11IE, _CN30IE, _CN31IE, _CN32IE, _CN56IE, _CN63IE;
+extern volatile unsigned short _CN17PUE, _CN18PUE, _CN83PUE;
+
+////////// CPU /////////////////////////////////////////////////////////////////
+
+extern volatile unsigned short port_ipl;
+extern void PortCheckInterrupts();
+extern void PortSleep(port_cpu_t mode);
+
+#define SET_AND_SAVE_CPU_IPL(save, ipl) do { save = port_ipl; port_ipl = ipl; } while (0)
+#define RESTORE_CPU_IPL(save) do { port_ipl = save; PortCheckInterrupts(); } while (0)
+#define SET_CPU_IPL(ipl) do { port_ipl = ipl; PortCheckInterrupts(); } while (0)
+
+#define Nop()
+#define ClrWdt()
+#define Sleep() PortSleep(pcSleep)
+#define Idle() PortSleep(pcIdle)
+
+// Find first set bit from the left/right (1-based, 0 if none)
+extern unsigned PortFF1L(unsigned x);
+extern unsigned PortFF1R(unsigned x);
+#define __builtin_ff1l(x) PortFF1L(x)
+#define __builtin_ff1r(x) PortFF1R(x)
+#define __builtin_btg(addr, bit) (*(volatile unsigned short*)(addr) ^= (1 << (bit)))
+
+#endif	/* P24FXXXX_H */
@@ -0,0 +1,19 @@
+/*
+ * File:   timer.h
+ * Author: Jared
+ *
+ * Host stand-in for the XC16 peripheral library timer definitions.
+ * T1CON is only written by InitializeSystick, so the values don't matter.
+ */
+
+#ifndef TIMER_H
+#define	TIMER_H
+
+#define T1_OFF              0xFFFF
+#define T1_IDLE_CON         0xFFFF
+#define T1_GATE_OFF         0xFFFF
+#define T1_PS_1_1           0xFFFF
+#define T1_SYNC_EXT_OFF     0xFFFF
+#define T1_SOURCE_EXT       0xFFFF
+
+#endif	/* TIMER_H */
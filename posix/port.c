@@ -0,0 +1,218 @@
+/*
+ * File:   port.c
+ * Author: Jared
+ *
+ * POSIX host port of the kernel (see port.h).
+ *
+ * Replaces kernel_asm.s: each task gets a ucontext, the T1 interrupt is
+ * taken whenever the virtual clock passes the PR1 match, and the context
+ * switch is a swapcontext() between the old and new task.
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#define _XOPEN_SOURCE 700
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "system.h"
+#include "core/kernel.h"
+#include "port.h"
+
+////////// Registers ///////////////////////////////////////////////////////////
+
+volatile unsigned short TRISB, PORTB, LATB, ANSB;
+volatile unsigned short TRISC, PORTC, LATC, ANSC;
+volatile unsigned short TRISD, PORTD, LATD, ANSD;
+volatile unsigned short TRISE, PORTE, LATE, ANSE;
+volatile unsigned short TRISF, PORTF, LATF, ANSF;
+volatile unsigned short TRISG, PORTG, LATG, ANSG;
+
+volatile unsigned short TMR1, PR1, T1CON;
+volatile unsigned short CLKDIV, RCON, SPLIM;
+volatile unsigned short PMD1, PMD2, PMD3, PMD4, PMD5, PMD6;
+
+volatile unsigned short _T1IF, _T1IE, _T1IP, _T1MD;
+volatile unsigned short _SESVD;
+volatile unsigned short _CN11IE, _CN30IE, _CN31IE, _CN32IE, _CN56IE, _CN63IE;
+volatile unsigned short _CN17PUE, _CN18PUE, _CN83PUE;
+
+volatile unsigned short port_ipl = 0;
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+port_stats_t port_stats;
+port_cpu_t port_cpu = pcRun;
+
+void (*port_clock_hook)(unsigned long counts) = NULL;
+
+static ucontext_t contexts[MAX_TASKS];
+static char* stacks[MAX_TASKS];
+
+static unsigned short ram[PORT_RAM_SIZE/2];
+
+// Firmware globals the kernel expects from other modules
+bool usb_connected = false;
+
+extern task_t* current_task;
+extern volatile tick_t next_switch_tick;
+extern volatile uint resched_pending;
+extern void KernelSwitchTask();
+extern void KernelTaskExit();
+
+////////// Methods /////////////////////////////////////////////////////////////
+
+unsigned short* PortStackPtr(unsigned short addr) {
+    return &ram[addr/2];
+}
+
+unsigned PortFF1L(unsigned x) {
+    int i;
+    for (i=15; i>=0; i--)
+        if (x & (1u << i))
+            return 16 - i;
+    return 0;
+}
+
+unsigned PortFF1R(unsigned x) {
+    int i;
+    for (i=0; i<16; i++)
+        if (x & (1u << i))
+            return i + 1;
+    return 0;
+}
+
+void PortAsm(const char* s) {
+    fprintf(stderr, "posix port: asm(\"%s\") has no host equivalent\n", s);
+    abort();
+}
+
+void CriticalError(const char* msg) {
+    fprintf(stderr, "CriticalError: %s\n", msg);
+    exit(2);
+}
+
+void PortResetStats() {
+    unsigned long long clock = port_stats.clock;
+    memset(&port_stats, 0, sizeof(port_stats));
+    port_stats.clock = clock;
+}
+
+static unsigned long long HostNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+////////// Context Switching ///////////////////////////////////////////////////
+
+static void TaskEntry(int index) {
+    // New tasks start with interrupts enabled, like the initial SR in kernel_asm.s
+    port_ipl = 0;
+    tasks[index].proc();
+    KernelTaskExit();
+}
+
+void KernelInitTaskStack(task_t* task, task_proc_t proc) {
+    int index = task - tasks;
+
+    if (stacks[index] == NULL) {
+        stacks[index] = malloc(PORT_STACK_SIZE);
+        if (stacks[index] == NULL)
+            CriticalError("Out of host memory");
+    }
+
+    getcontext(&contexts[index]);
+    contexts[index].uc_stack.ss_sp = stacks[index];
+    contexts[index].uc_stack.ss_size = PORT_STACK_SIZE;
+    contexts[index].uc_link = NULL;
+    makecontext(&contexts[index], (void (*)(void))TaskEntry, 1, index);
+}
+
+void KernelStartTask(task_t* task) {
+    setcontext(&contexts[task - tasks]);
+}
+
+void KernelSwitchContext() {
+    // Each context keeps its own IPL, the same as the SR pushed by the trap
+    unsigned short ipl = port_ipl;
+    task_t* prev = current_task;
+    unsigned long long t = HostNanoseconds();
+
+    KernelSwitchTask();
+
+    t = HostNanoseconds() - t;
+    port_stats.switches++;
+    port_stats.switch_ns += t;
+    if (t > port_stats.max_switch_ns)
+        port_stats.max_switch_ns = t;
+
+    if (current_task != prev)
+        swapcontext(&contexts[prev - tasks], &contexts[current_task - tasks]);
+
+    port_ipl = ipl;
+}
+
+static void T1Interrupt() {
+    // Same as __T1Interrupt in kernel_asm.s
+    _T1IF = 0;
+    systick++;
+    port_stats.systicks++;
+
+    if (!resched_pending && TickDiff(systick, next_switch_tick) < 0) {
+        port_stats.fast_ticks++;
+        return;
+    }
+
+    unsigned short ipl = port_ipl;
+    port_ipl = _T1IP;
+    KernelSwitchContext();
+    port_ipl = ipl;
+}
+
+void PortCheckInterrupts() {
+    if (_T1IF && _T1IE && port_ipl < _T1IP)
+        T1Interrupt();
+}
+
+////////// Virtual Clock ///////////////////////////////////////////////////////
+
+// Advance T1 by up to 'counts', stopping at the PR1 match.
+// Returns the number of counts actually advanced.
+static unsigned long AdvanceTimer(unsigned long counts) {
+    unsigned long to_match = (unsigned short)(PR1 - TMR1) + 1UL;
+
+    if (counts >= to_match) {
+        TMR1 = 0;
+        _T1IF = 1;
+        counts = to_match;
+    } else {
+        TMR1 += counts;
+    }
+
+    port_stats.clock += counts;
+    if (port_clock_hook)
+        port_clock_hook(counts);
+    return counts;
+}
+
+void PortBusy(unsigned long counts) {
+    while (counts) {
+        counts -= AdvanceTimer(counts);
+        PortCheckInterrupts();
+    }
+}
+
+void PortSleep(port_cpu_t mode) {
+    // Sleep until the next T1 match. Sleep and Idle wake on the interrupt flag
+    // even when the IPL masks it, the ISR runs once the IPL is restored.
+    if (!_T1IE)
+        CriticalError("Sleeping with no wakeup source");
+
+    port_cpu = mode;
+    while (!_T1IF)
+        AdvanceTimer(~0UL);
+    port_cpu = pcRun;
+}
@@ -0,0 +1,62 @@
+/*
+ * File:   port.h
+ * Author: Jared
+ *
+ * POSIX host port of the kernel, for simulation and benchmarking.
+ *
+ * Tasks run on ucontext stacks and the systick is driven from a virtual
+ * 32.768kHz clock: T1 only advances when a task burns CPU with PortBusy()
+ * or the idle task sleeps, so runs are deterministic and independent of
+ * the host's load.
+ */
+
+#ifndef PORT_H
+#define	PORT_H
+
+////////// Defines /////////////////////////////////////////////////////////////
+
+#define PORT_RAM_SIZE 0x10000   // Simulated data space, in bytes
+#define PORT_STACK_SIZE (256*1024) // Host stack allocated for each task context
+
+// Task stacks are painted and measured in the simulated data space
+#define KernelStackPtr(addr) PortStackPtr(addr)
+
+////////// Typedefs ////////////////////////////////////////////////////////////
+
+// What the simulated CPU is doing while the clock advances
+typedef enum {
+    pcRun,      // Executing (tasks and interrupts)
+    pcIdle,     // Idle(), peripherals clocked
+    pcSleep     // Sleep()
+} port_cpu_t;
+
+typedef struct {
+    unsigned long long clock;       // Virtual time, in T1 counts
+    unsigned long systicks;         // T1 interrupts taken
+    unsigned long fast_ticks;       // Systicks that skipped the scheduler
+    unsigned long switches;         // Calls into KernelSwitchTask
+    unsigned long long switch_ns;   // Host time spent in KernelSwitchTask
+    unsigned long max_switch_ns;
+} port_stats_t;
+
+////////// Methods /////////////////////////////////////////////////////////////
+
+// Map a 16-bit data space address into the simulated RAM
+extern unsigned short* PortStackPtr(unsigned short addr);
+
+// Burn CPU time in the current task, in T1 counts (33 per systick).
+// The systick is taken (and the task may be pre-empted) as the clock passes.
+extern void PortBusy(unsigned long counts);
+
+extern void PortResetStats();
+
+// Optional hook, called with each stretch of virtual time as the clock advances
+// (port_cpu holds the CPU state for that stretch). Used to integrate a current model.
+extern void (*port_clock_hook)(unsigned long counts);
+
+////////// Properties //////////////////////////////////////////////////////////
+
+extern port_stats_t port_stats;
+extern port_cpu_t port_cpu;
+
+#endif	/* PORT_H */
@@ -0,0 +1,354 @@
+/*
+ * File:   sim.c
+ * Author: Jared
+ *
+ * Battery life simulation (see sim.h).
+ *
+ * Boots the watch the same way main.c does, then a scenario task replays
+ * days of typical use in virtual time: glances at the clock, button
+ * navigation, a daily workout with the accelerometer sampling, and a
+ * nightly USB charge. At the end it prints the average battery drain per
+ * day and where it went.
+ *
+ * Usage: sim [days] [seed] [capacity mAh]
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "system.h"
+#include "core/kernel.h"
+#include "core/cpu.h"
+#include "core/os.h"
+#include "api/app.h"
+#include "api/graphics/gfx.h"
+#include "hardware.h"
+#include "background/power_monitor.h"
+#include "background/comms.h"
+#include "port.h"
+#include "sim.h"
+
+////////// Defines /////////////////////////////////////////////////////////////
+
+#define T1_FREQ 32768UL
+
+#define SECONDS(s) ((tick_t)((s) * (double)T1_FREQ / SYSTICK_TMR_PERIOD))
+#define MINUTES(m) SECONDS((m) * 60)
+#define HOURS(h) SECONDS((h) * 3600)
+
+#define BUTTON_HOLD SECONDS(0.15)   // How long a press lasts
+#define SAMPLE_INTERVAL 20          // Accelerometer sampling during a workout (systicks)
+
+// Where the battery charge goes
+typedef enum {
+    subCpuRun,
+    subCpuIdle,
+    subCpuSleep,
+    subOled,
+    subAccel,
+    subLeds,
+    subQuiescent,
+    NUM_SUBSYSTEMS
+} subsystem_t;
+
+static const char* subsystem_names[NUM_SUBSYSTEMS] = {
+    "CPU run", "CPU idle", "CPU sleep", "OLED", "Accelerometer", "LEDs", "Quiescent"
+};
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+double battery_charge;
+double battery_capacity = BATTERY_CAPACITY;
+
+static const double cpu_run_current[] = CPU_RUN_CURRENT;
+static const double cpu_idle_current[] = CPU_IDLE_CURRENT;
+
+// Battery charge used, in mA x T1 counts
+static double used[NUM_SUBSYSTEMS];
+static double charged;
+static double lowest_charge;
+
+static unsigned long long usb_time;     // T1 counts on USB power
+static unsigned long long screen_time;  // T1 counts with the display on
+static unsigned long long run_time;     // T1 counts with the CPU running
+static unsigned long long speed_time[4];// Run time at each cpu_speed_t
+
+static port_cpu_t last_cpu = pcRun;
+static unsigned long last_switches;
+
+static uint sim_days = 7;
+static uint glances, interactions;
+
+static soft_timer_t sample_timer;
+
+extern uint16 stack_base;
+extern uint current_app;
+extern void SimPinChange(uint cn_pin, bool value);
+
+////////// Current Model ///////////////////////////////////////////////////////
+
+static void SimClock(unsigned long counts) {
+    double current[NUM_SUBSYSTEMS] = { 0 };
+
+    switch (port_cpu) {
+        case pcRun:
+            current[subCpuRun] = cpu_run_current[cpu_speed];
+            run_time += counts;
+            speed_time[cpu_speed] += counts;
+            break;
+        case pcIdle: current[subCpuIdle] = cpu_idle_current[cpu_speed]; break;
+        case pcSleep: current[subCpuSleep] = CPU_SLEEP_CURRENT; break;
+    }
+
+    if (oled_on) {
+        current[subOled] = OLED_ON_CURRENT;
+        screen_time += counts;
+    } else if (oled_powered) {
+        current[subOled] = OLED_SLEEP_CURRENT;
+    }
+
+    current[subAccel] = (accel_mode == accStandby) ? ACCEL_STANDBY_CURRENT : ACCEL_MEASURE_CURRENT;
+    current[subLeds] = (_LAT(LED1) + _LAT(LED2)) * LED_CURRENT;
+    current[subQuiescent] = QUIESCENT_CURRENT;
+
+    // Energy that doesn't take any virtual time: waking the oscillator from
+    // Sleep, and the kernel's own work on each context switch.
+    double extra = 0;
+    if (last_cpu == pcSleep && port_cpu != pcSleep)
+        extra += CPU_WAKE_US * 1e-6 * T1_FREQ * cpu_run_current[cpu_speed];
+    last_cpu = port_cpu;
+    if (port_stats.switches != last_switches) {
+        extra += (double)(port_stats.switches - last_switches) * TASK_SLICE_CYCLES
+                * T1_FREQ / CpuFcy() * cpu_run_current[cpu_speed];
+        last_switches = port_stats.switches;
+    }
+
+    if (USB_VBUS_SENSE) {
+        // Everything runs from USB while the battery charges
+        usb_time += counts;
+        double charge = CHARGE_CURRENT * counts;
+        if (battery_charge + charge / (3600.0 * T1_FREQ) > battery_capacity)
+            charge = (battery_capacity - battery_charge) * 3600.0 * T1_FREQ;
+        charged += charge;
+        battery_charge += charge / (3600.0 * T1_FREQ);
+        return;
+    }
+
+    subsystem_t i;
+    double total = 0;
+    for (i=0; i<NUM_SUBSYSTEMS; i++) {
+        double charge = current[i] * counts;
+        if (i == subCpuRun)
+            charge += extra;
+        used[i] += charge;
+        total += charge;
+    }
+    battery_charge -= total / (3600.0 * T1_FREQ);
+    if (battery_charge < 0)
+        battery_charge = 0;
+    if (battery_charge < lowest_charge)
+        lowest_charge = battery_charge;
+}
+
+////////// Apps ////////////////////////////////////////////////////////////////
+
+static void DrawApp() {
+    SimCycles(APP_DRAW_CYCLES);
+}
+
+// The clock face only changes on the minute, so it's drawn ahead of time
+static tick_t PrerenderClock() {
+    SimCycles(APP_DRAW_CYCLES);
+    return (GetTicks() / MINUTES(1) + 1) * MINUTES(1);
+}
+
+static application_t clock_app = { .name = "Clock", .draw = DrawApp, .prerender = PrerenderClock, .redraw = rdMinute };
+static application_t menu_app = { .name = "Menu", .draw = DrawApp, .redraw = rdOnDemand };
+
+////////// Scenario ////////////////////////////////////////////////////////////
+
+static tick_t RandomTicks(tick_t min, tick_t max) {
+    return min + (tick_t)((double)rand() / RAND_MAX * (max - min));
+}
+
+static void PressButton(uint cn_pin) {
+    SimPinChange(cn_pin, true);
+    WaitUntil(GetTicks() + BUTTON_HOLD);
+    SimPinChange(cn_pin, false);
+}
+
+static void SetPowerPins(bool usb) {
+    // PW_STAT1 low while charging, PW_STAT2 low once charged
+    bool full = battery_charge >= battery_capacity;
+    _PORT(PW_STAT1) = !usb || full;
+    _PORT(PW_STAT2) = !usb || !full;
+}
+
+static void SetUsb(bool attached) {
+    _SESVD = attached;
+    usb_connected = attached;
+    SetPowerPins(attached);
+}
+
+static void Glance(tick_t when) {
+    WaitUntil(when);
+    PressButton(_CNIDX(BTN1_CN));
+    glances++;
+
+    // Sometimes look through the apps, otherwise the screen times out
+    if (rand() % 4 == 0) {
+        interactions++;
+        uint presses = 3 + rand() % 6;
+        while (presses--) {
+            WaitUntil(GetTicks() + RandomTicks(SECONDS(1), SECONDS(3)));
+            PressButton((current_app == 0) ? _CNIDX(BTN3_CN) : _CNIDX(BTN2_CN));
+        }
+        if (rand() % 2)
+            PressButton(_CNIDX(BTN4_CN)); // Screen off
+    }
+}
+
+static void SampleAccel(uint param) {
+    // A sensor app keeps the accelerometer measuring, even if the screen turns off
+    if (accel_mode != accMeasure)
+        accel_SetMode(accMeasure);
+    accel_ReadXYZ();
+}
+
+static void Workout(tick_t start, tick_t length) {
+    WaitUntil(start);
+    accel_SetMode(accMeasure);
+    TimerStart(&sample_timer, SAMPLE_INTERVAL, SAMPLE_INTERVAL);
+
+    // Check the time now and then
+    while (TickAfter(start + length, GetTicks() + MINUTES(5)))
+        Glance(GetTicks() + MINUTES(5));
+
+    WaitUntil(start + length);
+    TimerStop(&sample_timer);
+    accel_SetMode(accStandby);
+}
+
+static void Report();
+
+static void ScenarioTask() {
+    // Day 0 starts at 07:00 with a full battery, just unplugged
+    tick_t day_start = GetTicks();
+    TimerInit(&sample_timer, SampleAccel, 0);
+
+    uint day;
+    for (day=0; day<sim_days; day++) {
+        tick_t t = day_start;
+        bool worked_out = false;
+
+        // Glances through the day, with a workout at 18:00
+        while (1) {
+            t += RandomTicks(MINUTES(5), MINUTES(20));
+            if (!TickAfter(day_start + HOURS(16), t))
+                break;
+
+            if (!worked_out && TickAfter(t, day_start + HOURS(11))) {
+                Workout(day_start + HOURS(11), MINUTES(30));
+                worked_out = true;
+            } else {
+                Glance(t);
+            }
+            t = GetTicks();
+        }
+
+        // Charge for an hour at 23:00, then sleep
+        WaitUntil(day_start + HOURS(16));
+        SetUsb(true);
+        while (TickAfter(day_start + HOURS(17), GetTicks())) {
+            WaitUntil(GetTicks() + MINUTES(1));
+            SetPowerPins(true);
+        }
+        SetUsb(false);
+
+        day_start += HOURS(24);
+        WaitUntil(day_start);
+    }
+
+    Report();
+}
+
+////////// Report //////////////////////////////////////////////////////////////
+
+static double ToHours(unsigned long long counts) {
+    return counts / (3600.0 * T1_FREQ);
+}
+
+static void Report() {
+    double hours = ToHours(port_stats.clock);
+    double battery_hours = hours - ToHours(usb_time);
+    double total = 0;
+    subsystem_t i;
+    for (i=0; i<NUM_SUBSYSTEMS; i++)
+        total += used[i];
+
+    // mA x T1 counts -> mAh per day on battery
+    double scale = 24.0 / battery_hours / (3600.0 * T1_FREQ);
+
+    printf("Simulated %.1f days (%.1fh on battery, %.1fh on USB)\n",
+            hours / 24, battery_hours, ToHours(usb_time));
+    printf("%u glances, %u with navigation, screen on %.2f%% of the time\n",
+            glances, interactions, 100.0 * screen_time / port_stats.clock);
+    printf("CPU running %.3f%% of the time (32/16/8/4MHz: %.0f/%.0f/%.0f/%.0f%%), %.1f wakeups/s\n",
+            100.0 * run_time / port_stats.clock,
+            100.0 * speed_time[cpu32MHz] / run_time, 100.0 * speed_time[cpu16MHz] / run_time,
+            100.0 * speed_time[cpu8MHz] / run_time, 100.0 * speed_time[cpu4MHz] / run_time,
+            port_stats.systicks / (hours * 3600));
+    printf("\n");
+
+    printf("Battery drain: %.2f mAh/day\n", total * scale);
+    for (i=0; i<NUM_SUBSYSTEMS; i++) {
+        printf("  %-14s %8.3f mAh/day  %5.1f%%\n", subsystem_names[i],
+                used[i] * scale, 100.0 * used[i] / total);
+    }
+    printf("\n");
+
+    printf("Estimated battery life: %.1f days (%.0f mAh), lowest charge %.0f%%, %.1f mAh charged over USB\n",
+            battery_capacity / (total * scale), battery_capacity,
+            100.0 * lowest_charge / battery_capacity, charged / (3600.0 * T1_FREQ));
+
+    fflush(stdout);
+    exit(0);
+}
+
+////////// Main ////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    if (argc > 1)
+        sim_days = atoi(argv[1]);
+    srand((argc > 2) ? atoi(argv[2]) : 1);
+    if (argc > 3)
+        battery_capacity = atof(argv[3]);
+    battery_charge = battery_capacity;
+    lowest_charge = battery_capacity;
+
+    // Simulated data space for the task stacks
+    stack_base = 0x1000;
+    SPLIM = PORT_RAM_SIZE - 0x1000;
+
+    port_clock_hook = SimClock;
+    SetUsb(false);
+
+    // Same order as main.c
+    InitializeKernel();
+    InitializeCpuGovernor();
+    InitializeOS();
+
+    RegisterUserApplication(&clock_app);
+    RegisterUserApplication(&menu_app);
+    SetForegroundApp(&clock_app);
+    current_app = 0;
+
+    StartBootTasks();
+
+    RegisterTask("Scene", ScenarioTask, prRealtime, TASK_STACK_SIZE);
+
+    KernelStart();
+    return 1;
+}
@@ -0,0 +1,73 @@
+/*
+ * File:   sim.h
+ * Author: Jared
+ *
+ * Battery life simulation on the posix port.
+ *
+ * The real OS, kernel, power monitor and CPU governor run against simulated
+ * drivers (sim_drivers.c). Driver calls burn virtual time with the cycle
+ * costs below, and a current model is integrated over the virtual clock.
+ *
+ * The currents are approximate datasheet typicals at 3.3V, calibrate them
+ * against a bench measurement before trusting the absolute numbers.
+ * Relative changes (eg. a power regression) show up regardless.
+ */
+
+#ifndef SIM_H
+#define	SIM_H
+
+#include "drivers/MMA7455.h"
+
+////////// Current Model ///////////////////////////////////////////////////////
+
+// PIC24FJ256DA206, indexed by cpu_speed_t (mA)
+#define CPU_RUN_CURRENT     { 13.0, 7.5, 4.5, 3.0 }
+#define CPU_IDLE_CURRENT    { 4.5, 3.0, 2.2, 1.8 }
+#define CPU_SLEEP_CURRENT   0.025   // SOSC, T1 and WDT running
+
+#define CPU_WAKE_US         200     // Oscillator/PLL start-up after Sleep, at run current
+#define TASK_SLICE_CYCLES   400     // Kernel switch plus a short task body, charged per switch
+
+// SSD1351 OLED panel (mA)
+#define OLED_ON_CURRENT     18.0    // Mostly dark watch face
+#define OLED_SLEEP_CURRENT  0.01    // Powered, display off
+
+// MMA7455 accelerometer (mA)
+#define ACCEL_MEASURE_CURRENT 0.4
+#define ACCEL_STANDBY_CURRENT 0.0025
+
+#define LED_CURRENT         1.5     // Each status LED (mA)
+#define QUIESCENT_CURRENT   0.035   // Regulator, charger and VBAT divider (mA)
+
+#define CHARGE_CURRENT      100.0   // USB charge current (mA), see power_monitor.c
+#define BATTERY_CAPACITY    100     // Default capacity for the life estimate (mAh)
+
+////////// Cycle Costs /////////////////////////////////////////////////////////
+
+#define CLEAR_IMAGE_CYCLES  20000UL     // 128x128x16bpp framebuffer fill
+#define DRAW_PRIMITIVE_CYCLES 2000UL    // Box, image or short string
+#define UPDATE_DISPLAY_CYCLES 200000UL  // Framebuffer push over the 8-bit parallel bus
+#define TRANSITION_CYCLES   UPDATE_DISPLAY_CYCLES // App switch animation, in total
+#define APP_DRAW_CYCLES     60000UL     // Foreground app draw callback
+#define ACCEL_READ_US       250         // XYZ read over I2C (busy wait, independent of CPU speed)
+
+////////// Methods /////////////////////////////////////////////////////////////
+
+// Burn CPU time, in instruction cycles at the current CPU speed
+extern void SimCycles(uint32 cycles);
+
+// Burn CPU time, in microseconds
+extern void SimBusyUs(uint32 us);
+
+////////// Properties //////////////////////////////////////////////////////////
+
+// Simulated peripheral state, read by the current model
+extern bool oled_powered;
+extern bool oled_on;
+extern accel_mode_t accel_mode;
+
+// Battery state of charge (mAh remaining)
+extern double battery_charge;
+extern double battery_capacity;
+
+#endif	/* SIM_H */
@@ -0,0 +1,228 @@
+/*
+ * File:   sim_drivers.c
+ * Author: Jared
+ *
+ * Simulated drivers for the battery life simulation (see sim.h).
+ *
+ * Each stand-in records the peripheral state the current model needs and
+ * burns the CPU time the real driver would. Interrupt-driven drivers hand
+ * their callbacks to the kernel's worker task, the same as the real ones.
+ */
+
+////////// Includes ////////////////////////////////////////////////////////////
+
+#include <system.h>
+#include "core/kernel.h"
+#include "core/cpu.h"
+#include "hardware.h"
+#include "api/graphics/gfx.h"
+#include "api/graphics/font.h"
+#include "api/graphics/imfont.h"
+#include "api/clock.h"
+#include "drivers/ssd1351.h"
+#include "drivers/MMA7455.h"
+#include "peripherals/gpio.h"
+#include "peripherals/cn.h"
+#include "peripherals/adc.h"
+#include "peripherals/i2c.h"
+#include "port.h"
+#include "sim.h"
+
+////////// Variables ///////////////////////////////////////////////////////////
+
+bool oled_powered = false;
+bool oled_on = false;
+accel_mode_t accel_mode = accStandby;
+vector3i_t accel_current;
+
+drawop_t global_drawop;
+const fonts_t fonts;
+
+static cn_cb cn_callbacks[NUM_CN_PINS];
+static bool cn_in_isr[NUM_CN_PINS];
+static adc_conversion_cb adc_callbacks[ADC_CHANNELS];
+static voltage_t adc_voltages[ADC_CHANNELS];
+
+static uint transition_interval, transition_steps, transition_left;
+
+// Fractional T1 counts left over from SimCycles
+static uint32 cycle_remainder;
+
+////////// Timing //////////////////////////////////////////////////////////////
+
+void SimCycles(uint32 cycles) {
+    // T1 counts = cycles * 32768 / Fcy, keeping the remainder so lots of
+    // short calls add up to the right amount of time.
+    unsigned long long scaled = (unsigned long long)cycles * 32768 + cycle_remainder;
+    uint32 fcy = CpuFcy();
+    cycle_remainder = scaled % fcy;
+    PortBusy(scaled / fcy);
+}
+
+void SimBusyUs(uint32 us) {
+    SimCycles((unsigned long long)us * CpuFcy() / 1000000);
+}
+
+////////// Graphics ////////////////////////////////////////////////////////////
+
+void ClearImage() {
+    SimCycles(CLEAR_IMAGE_CYCLES);
+}
+
+void DrawBox(uint8 x, uint8 y, uint8 w, uint8 h, color_t border, color_t fill) {
+    SimCycles(DRAW_PRIMITIVE_CYCLES);
+}
+
+void DrawImage(int x, int y, const image_t* image) {
+    SimCycles(DRAW_PRIMITIVE_CYCLES);
+}
+
+int DrawString(const char* str, uint8 x, uint8 y, color_t color) {
+    SimCycles(DRAW_PRIMITIVE_CYCLES);
+    return 0;
+}
+
+int DrawImString(const char* str, uint8 x, uint8 y, color_t color) {
+    SimCycles(DRAW_PRIMITIVE_CYCLES);
+    return 0;
+}
+
+void SetFont(const font_t* font) {
+}
+
+void SetFontSize(unsigned int size) {
+}
+
+void UpdateDisplay() {
+    SimCycles(UPDATE_DISPLAY_CYCLES);
+}
+
+// A wipe pushes about one framebuffer in total, spread over its steps
+void TransitionStart(transition_t type, int dir, uint duration, uint fps) {
+    transition_interval = SecondsToTicks(1) / fps;
+    transition_steps = transition_left = duration / transition_interval + 1;
+}
+
+uint TransitionStep() {
+    SimCycles(TRANSITION_CYCLES / transition_steps);
+    return (--transition_left == 0) ? 0 : transition_interval;
+}
+
+void TransitionCancel() {
+    transition_left = 0;
+}
+
+void DisplayCleared() {
+}
+
+bool DrawToOffscreen(bool enable) {
+    static bool offscreen = false;
+    bool prev = offscreen;
+    offscreen = enable;
+    return prev;
+}
+
+void SwapScreenBuffers() {
+}
+
+////////// RTC /////////////////////////////////////////////////////////////////
+
+// Virtual time of day, the scenario starts at 07:00
+timestamp_t ClockNow() {
+    timestamp_t ts = { .raw = 0 };
+    unsigned long long seconds = port_stats.clock / 32768 + 7 * 3600UL;
+    ts.sec = seconds % 60;
+    ts.min = seconds / 60 % 60;
+    ts.hour = seconds / 3600 % 24;
+    return ts;
+}
+
+////////// OLED ////////////////////////////////////////////////////////////////
+
+void ssd1351_PowerOn() {
+    oled_powered = true;
+}
+
+void ssd1351_PowerOff() {
+    oled_powered = false;
+    oled_on = false;
+}
+
+void ssd1351_DisplayOn() {
+    oled_on = true;
+}
+
+void ssd1351_DisplayOff() {
+    oled_on = false;
+}
+
+////////// Accelerometer ///////////////////////////////////////////////////////
+
+void accel_SetMode(accel_mode_t mode) {
+    SimBusyUs(ACCEL_READ_US / 3); // One register write
+    accel_mode = mode;
+}
+
+vector3i_t accel_ReadXYZ() {
+    SimBusyUs(ACCEL_READ_US);
+    return accel_current;
+}
+
+////////// I2C /////////////////////////////////////////////////////////////////
+
+void i2c_set_clock(uint32 fcy) {
+}
+
+////////// Pin Change //////////////////////////////////////////////////////////
+
+void cn_register_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
+    cn_callbacks[cn_pin] = callback;
+    cn_in_isr[cn_pin] = false;
+}
+
+void cn_register_isr_cb(uint cn_pin, pinref_t pinref, cn_cb callback) {
+    cn_callbacks[cn_pin] = callback;
+    cn_in_isr[cn_pin] = true;
+}
+
+static void cn_dispatch(uint param) {
+    cn_callbacks[param >> 1](param & 1);
+}
+
+// Called by the scenario when a pin changes, like _CNInterrupt
+void SimPinChange(uint cn_pin, bool value) {
+    if (cn_callbacks[cn_pin] == NULL)
+        return;
+
+    KernelIsrEnter(kiCN);
+    if (cn_in_isr[cn_pin])
+        cn_callbacks[cn_pin](value);
+    else
+        KernelDefer(cn_dispatch, (cn_pin << 1) | value);
+    KernelIsrExit(kiCN);
+}
+
+////////// ADC /////////////////////////////////////////////////////////////////
+
+static void adc_dispatch(uint channel) {
+    adc_callbacks[channel](adc_voltages[channel]);
+}
+
+void adc_SetCallback(uint8 channel, adc_conversion_cb callback) {
+    adc_callbacks[channel] = callback;
+}
+
+void adc_StartConversion(uint8 channel) {
+    if (channel != AN_VBAT || adc_callbacks[channel] == NULL)
+        return;
+
+    // Battery voltage from the state of charge, divided by 2 like the board.
+    // Roughly linear over the range power_monitor.c maps to 0-100%.
+    double level = battery_charge / battery_capacity;
+    voltage_t vbat = 3550 + (uint)(650 * level);
+
+    KernelIsrEnter(kiADC);
+    adc_voltages[channel] = vbat / 2;
+    KernelDefer(adc_dispatch, channel);
+    KernelIsrExit(kiADC);
+}
@@ -0,0 +1,125 @@
+"""
+Converts a kernel trace dump into a Chrome/Perfetto trace (JSON).
+
+The input is the raw CMD_GET_TRACE (0x14) response packets (64 bytes each)
+concatenated together, as read from the watch over USB. Open the output in
+chrome://tracing or https://ui.perfetto.dev
+
+Usage: trace2json.py trace.bin [out.json] [--names idle,Work,Core,...]
+"""
+from __future__ import print_function
+import sys
+import json
+import struct
+
+PACKET_SIZE = 64
+CMD_GET_TRACE = 0x14
+TRACE_PACKET_RECORDS = 7
+RECORD_FORMAT = '<IBBH'     # trace_record_t
+RECORD_SIZE = struct.calcsize(RECORD_FORMAT)
+
+T1_FREQ = 32768.0           # T1 counts per second
+
+# trace_event_t
+TR_SWITCH, TR_ISR_ENTER, TR_ISR_EXIT, TR_DELAY, TR_WAIT_UNTIL, TR_BLOCK = range(6)
+
+# kernel_isr_t
+ISR_NAMES = ['CN', 'ADC']
+
+ISR_PID = 1
+TASK_PID = 0
+
+def read_records(data):
+    records = []
+    dropped = 0
+    for offset in range(0, len(data) - PACKET_SIZE + 1, PACKET_SIZE):
+        packet = data[offset:offset + PACKET_SIZE]
+        command, error, count, dropped = struct.unpack_from('<BBBH', packet, 0)
+        if command != CMD_GET_TRACE or error != 0:
+            continue
+        for i in range(min(count, TRACE_PACKET_RECORDS)):
+            records.append(struct.unpack_from(RECORD_FORMAT, packet, 5 + i * RECORD_SIZE))
+    return records, dropped
+
+def to_us(time, start):
+    # T1 counts wrap after 2^32, so use the difference from the first record
+    return ((time - start) & 0xFFFFFFFF) * 1e6 / T1_FREQ
+
+def task_name(names, index):
+    if index < len(names):
+        return names[index]
+    return 'task%d' % index
+
+def convert(records, names):
+    events = []
+    if not records:
+        return events
+    start = records[0][0]
+
+    events.append({'ph': 'M', 'pid': TASK_PID, 'name': 'process_name', 'args': {'name': 'Tasks'}})
+    events.append({'ph': 'M', 'pid': ISR_PID, 'name': 'process_name', 'args': {'name': 'Interrupts'}})
+
+    current = None      # (task index, start time)
+    for (time, event, arg, param) in records:
+        ts = to_us(time, start)
+
+        if event == TR_SWITCH:
+            if current is not None:
+                events.append({'ph': 'X', 'pid': TASK_PID, 'tid': current[0],
+                               'name': task_name(names, current[0]),
+                               'ts': current[1], 'dur': ts - current[1]})
+            current = (arg, ts)
+
+        elif event in (TR_ISR_ENTER, TR_ISR_EXIT):
+            name = ISR_NAMES[arg] if arg < len(ISR_NAMES) else 'isr%d' % arg
+            events.append({'ph': 'B' if event == TR_ISR_ENTER else 'E',
+                           'pid': ISR_PID, 'tid': arg, 'name': name, 'ts': ts})
+
+        elif event == TR_DELAY:
+            events.append({'ph': 'i', 's': 't', 'pid': TASK_PID, 'tid': arg,
+                           'name': 'Delay(%d)' % param, 'ts': ts})
+
+        elif event == TR_WAIT_UNTIL:
+            events.append({'ph': 'i', 's': 't', 'pid': TASK_PID, 'tid': arg,
+                           'name': 'WaitUntil(%d)' % param, 'ts': ts})
+
+        elif event == TR_BLOCK:
+            timeout = 'forever' if param == 0xFFFF else str(param)
+            events.append({'ph': 'i', 's': 't', 'pid': TASK_PID, 'tid': arg,
+                           'name': 'Block(%s)' % timeout, 'ts': ts})
+
+    # Name the task rows
+    for index in sorted(set(e['tid'] for e in events if e.get('pid') == TASK_PID and 'tid' in e)):
+        events.append({'ph': 'M', 'pid': TASK_PID, 'tid': index, 'name': 'thread_name',
+                       'args': {'name': task_name(names, index)}})
+    return events
+
+def main(argv):
+    names = []
+    args = []
+    i = 0
+    while i < len(argv):
+        if argv[i] == '--names' and i + 1 < len(argv):
+            names = argv[i + 1].split(',')
+            i += 2
+        else:
+            args.append(argv[i])
+            i += 1
+
+    if not args:
+        print(__doc__)
+        return 1
+
+    with open(args[0], 'rb') as f:
+        records, dropped = read_records(f.read())
+
+    trace = {'traceEvents': convert(records, names), 'displayTimeUnit': 'ms'}
+    out = args[1] if len(args) >= 2 else 'trace.json'
+    with open(out, 'w') as f:
+        json.dump(trace, f)
+
+    print('%d records (%d dropped) written to %s' % (len(records), dropped, out))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
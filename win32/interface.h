@@ -14,7 +14,7 @@ extern uint8 ol_contrast;
 
 // GFX Library Stuff
 #include "api\graphics\gfx.h"
-extern color_t screen[DISPLAY_SIZE];
+extern color_t* screen;
 
 // Power Monitor
 #include "api\power_monitor.h"
@@ -16,7 +16,7 @@ extern bool ol_power;
 extern uint8 ol_contrast;
 
 // GFX Library Stuff
-extern color_t screen[DISPLAY_SIZE];
+extern color_t* screen;
 
 // Power Monitor
 extern charge_status_t charge_status;
@@ -160,8 +160,8 @@ DLLEXPORT task_t* zGetTask(uint index) {
 	return NULL;
 }
 
-extern volatile uint systick;
-DLLEXPORT void zSetSystick(uint tick) {
+extern volatile tick_t systick;
+DLLEXPORT void zSetSystick(tick_t tick) {
 	systick = tick;
 }
 
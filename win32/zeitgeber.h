@@ -40,7 +40,7 @@ typedef void (*proc_t)(void);
 extern uint8 ol_contrast;
 
 // GFX Library Stuff
-extern color_t screen[DISPLAY_SIZE];
+extern color_t* screen;
 
 // Power Monitor
 extern charge_status_t charge_status;